@@ -1,18 +1,266 @@
 #include "WebSocket.h"
+#include "WebSocketFrame.h"
 #include "sha1.h"
 #include "base64.h"
+#ifdef __AVR__
+#include <avr/sleep.h>
+#endif
 
-WebSocket::WebSocket(uint16_t port, char *supportedProtocol, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose, onError_t onError) : server(port) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+// Length of a queued frame; frames that fit in the output buffer never need a 64-bit length.
+static int queuedFrameLength(const uint8_t *frame) {
+  if ((frame[1] & 0x7f) == WS_LENGTH_16) {
+    return 4 + ((frame[2] << 8) | frame[3]);
+  }
+  return WS_HEADER_LENGTH + (frame[1] & 0x7f);
+}
+
+static void setBucket(wsTokenBucket *bucket, uint32_t rate, uint16_t burst) {
+  // A bucket that cannot hold a full output buffer would hold back the largest queued frame forever.
+  if (rate && burst < WS_OUTPUT_BUFFER_SIZE) {
+    burst = WS_OUTPUT_BUFFER_SIZE;
+  }
+  bucket->rate = rate;
+  bucket->burst = burst;
+  bucket->tokens = burst;
+  bucket->refilledAt = millis();
+}
+
+// Adds the tokens earned since the last refill, up to burst.
+static void refill(wsTokenBucket *bucket) {
+  unsigned long now = millis();
+  unsigned long elapsed = now - bucket->refilledAt;
+  uint64_t added;
+
+  if (!bucket->rate || !elapsed) {
+    return;
+  }
+  // 64 bits: elapsed * rate overflows 32 for rates above a few MB/s.
+  added = (uint64_t)elapsed * bucket->rate / 1000;
+  if (added == 0) {
+    return;
+  }
+  if ((int64_t)bucket->tokens + (int64_t)added >= bucket->burst) {
+    bucket->tokens = bucket->burst;
+    bucket->refilledAt = now;
+    return;
+  }
+  // Advance only by the time the added tokens account for, so fractions are not lost.
+  bucket->refilledAt += (unsigned long)(added * 1000 / bucket->rate);
+  bucket->tokens += (int32_t)added;
+}
+
+// Milliseconds until the bucket has a token again.
+static unsigned long tokenWait(wsTokenBucket *bucket) {
+  if (!bucket->rate || bucket->tokens > 0) {
+    return 0;
+  }
+  if (1 - bucket->tokens > 4000000L) {
+    return 1000;
+  }
+  return ((unsigned long)(1 - bucket->tokens) * 1000 + bucket->rate - 1) / bucket->rate;
+}
+#endif
+
+#if WS_USE_STATS
+static void recordDuration(uint16_t *histogram, unsigned long duration) {
+  int bucket = 0;
+
+  for (unsigned long limit = 64; bucket < WS_HISTOGRAM_BUCKETS - 1 && duration >= limit; limit <<= 2) {
+    bucket++;
+  }
+  if (histogram[bucket] < 0xffff) {
+    histogram[bucket]++;
+  }
+}
+
+static wsHandshakeFailure handshakeFailure(int retval) {
+  switch (retval) {
+    case WS_LINE_TOO_LONG:
+      return WS_FAILED_LINE_TOO_LONG;
+    case WS_STATUS_MISMATCH:
+      return WS_FAILED_STATUS_MISMATCH;
+    case WS_NOT_SUPPORTED:
+      return WS_FAILED_NOT_SUPPORTED;
+    case WS_NOT_FOUND:
+      return WS_FAILED_NOT_FOUND;
+    default:
+      return WS_FAILED_OTHER;
+  }
+}
+
+// Encodes the header into the WS_MAX_HEADER_LENGTH bytes reserved in front of payload.
+static int prependHeader(uint8_t *payload, int payloadLength, uint8_t opcode) {
+  uint8_t header[WS_MAX_HEADER_LENGTH];
+  int headerLength = wsEncodeHeader(header, payloadLength, opcode);
+
+  memcpy(payload - headerLength, header, headerLength);
+  return headerLength;
+}
+#endif
+
+WebSocket::WebSocket(uint16_t port, char *supportedProtocol, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose, onError_t onError, wsConfig) : server(port) {
+  this->port = port;
+  init(&supportedProtocol, supportedProtocol ? 1 : 0, onOpen, onMessage, onClose, onError);
+}
+
+WebSocket::WebSocket(uint16_t port, char **supportedProtocols, uint8_t numProtocols, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose, onError_t onError, wsConfig) : server(port) {
   this->port = port;
-  this->supportedProtocol = strdup(supportedProtocol);
+  init(supportedProtocols, numProtocols, onOpen, onMessage, onClose, onError);
+}
+
+void WebSocket::init(char **supportedProtocols, uint8_t numProtocols, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose, onError_t onError) {
+  int maxLineLength = 0;
+  int templateLength;
+
+  if (numProtocols > WS_MAX_PROTOCOLS) {
+    numProtocols = WS_MAX_PROTOCOLS;
+  }
   this->onOpen = onOpen;
   this->onMessage = onMessage;
   this->onClose = onClose;
   this->onError = onError;
+  arenaUsed = 0;
+
+  for (int i = 0; i < numProtocols; i++) {
+    protocolLength[i] = strlen(supportedProtocols[i]);
+    if (protocolLength[i] > maxLineLength) {
+      maxLineLength = protocolLength[i];
+    }
+  }
+
+  // Constant part of the 101 response: header, room for the Accept key, the extension line, and the longest protocol tail.
+  templateLength = WS_RESPONSE_HEADER_LENGTH + WS_ACCEPT_LENGTH + 2 + WS_PROTOCOL_HEADER_LENGTH + maxLineLength + 4;
+#if WS_USE_DEFLATE
+  templateLength += WS_EXTENSION_LINE_LENGTH;
+#endif
+  if ((response = allocate(templateLength))) {
+    memcpy(response, WS_RESPONSE_HEADER, WS_RESPONSE_HEADER_LENGTH);
+  }
+
+  // Each protocol is kept as its complete response tail so that the handshake only has to copy it.
+  // Protocols the arena has no room for are not offered.
+  this->numProtocols = 0;
+  for (int i = 0; i < numProtocols; i++) {
+    if (!(protocolLine[i] = allocate(WS_PROTOCOL_HEADER_LENGTH + protocolLength[i] + 5))) {
+      break;
+    }
+    memcpy(protocolLine[i], WS_PROTOCOL_HEADER, WS_PROTOCOL_HEADER_LENGTH);
+    memcpy(protocolLine[i] + WS_PROTOCOL_HEADER_LENGTH, supportedProtocols[i], protocolLength[i]);
+    memcpy(protocolLine[i] + WS_PROTOCOL_HEADER_LENGTH + protocolLength[i], "\r\n\r\n", 5);
+    this->numProtocols++;
+  }
 
   for (int i = 0; i < MAX_SOCK_NUM; i++) {
     status[i] = CLOSED;
+    route[i] = WS_NO_ROUTE;
+  }
+  numRoutes = 0;
+  for (int i = 0; i < WS_MAX_TOPICS; i++) {
+    subscribers[i] = 0;
   }
+  streamChunkSize = WS_STREAM_CHUNK_SIZE;
+  wsTimerInit(&timers, millis());
+#if WS_USE_SUBMIT_QUEUE
+  wsQueueInit(&submitted);
+#endif
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  flushDeadline = 0;
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    output[i] = NULL;
+    setBucket(&shaper[i], 0, 0);
+  }
+  for (int i = 0; i < WS_CONNECTION_BLOCKS; i++) {
+    freeBlocks[i] = WS_CONNECTION_BLOCKS - 1 - i;
+  }
+  numFree = WS_CONNECTION_BLOCKS;
+  blocksHighWater = 0;
+  setBucket(&globalShaper, 0, 0);
+#endif
+#if WS_USE_DEFLATE
+  compressionDisabled = 0;
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    windowBits[i] = 0;
+  }
+#endif
+#if WS_USE_STATS
+  statsClients = 0;
+  resetStats();
+#endif
+#if WS_USE_CAPTURE
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    transport[i].target = &client[i];
+    transport[i].capture = &capture;
+    transport[i].clientId = i;
+  }
+#endif
+}
+
+// Memory that lives as long as the server: from the arena in arena mode, otherwise from the heap.
+char *WebSocket::allocate(int size) {
+#if WS_USE_ARENA
+  char *allocated;
+
+  if (arenaUsed + size > WS_ARENA_SIZE) {
+    return NULL;
+  }
+  allocated = arena + arenaUsed;
+#else
+  char *allocated = (char *)malloc(size);
+
+  if (!allocated) {
+    return NULL;
+  }
+#endif
+  arenaUsed += size;
+  return allocated;
+}
+
+// Gives the slot an output buffer from the free list, or turns the client away with a 503.
+int WebSocket::acquire(int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out;
+
+  if (numFree == 0) {
+    io(clientId).write((const uint8_t *)WS_UNAVAILABLE_RESPONSE, sizeof(WS_UNAVAILABLE_RESPONSE) - 1);
+    return WS_ERROR;
+  }
+  out = output[clientId] = &blocks[freeBlocks[--numFree]];
+  out->length = 0;
+  out->frameRemaining = 0;
+  out->controlLength = 0;
+  out->prepared = NULL;
+  for (int i = 0; i < WS_LATEST_SLOTS; i++) {
+    out->latest[i] = -1;
+  }
+  // A limit set on the slot stays for each connection on it, the debt does not.
+  setBucket(&shaper[clientId], shaper[clientId].rate, shaper[clientId].burst);
+  if (WS_CONNECTION_BLOCKS - numFree > blocksHighWater) {
+    blocksHighWater = WS_CONNECTION_BLOCKS - numFree;
+  }
+#endif
+  return WS_OK;
+}
+
+wsMemoryUsage WebSocket::getMemoryUsage() {
+  wsMemoryUsage usage;
+
+  usage.arenaUsed = arenaUsed;
+#if WS_USE_ARENA
+  usage.arenaSize = WS_ARENA_SIZE;
+#else
+  usage.arenaSize = 0;
+#endif
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  usage.blocks = WS_CONNECTION_BLOCKS;
+  usage.blocksInUse = WS_CONNECTION_BLOCKS - numFree;
+  usage.blocksHighWater = blocksHighWater;
+#else
+  usage.blocks = 0;
+  usage.blocksInUse = 0;
+  usage.blocksHighWater = 0;
+#endif
+  return usage;
 }
 
 void WebSocket::begin() {
@@ -20,49 +268,25 @@ void WebSocket::begin() {
 }
 
 int WebSocket::available(int *clientId) {
-  char payloadData[WS_MAX_PAYLOAD_LENGTH + 1];
-  int payloadLength;
-  char requestURI[WS_MAX_LINE_LENGTH];
-  int opcode;
   EthernetClient c;
-  int retval = WS_ERROR;
-  
+  int retval;
+
   *clientId = -1;
 
+  flushExpired();
+  wsTimerTick(&timers, millis());
+#if WS_USE_SUBMIT_QUEUE
+  sendSubmitted();
+#endif
+
   if (c = server.available()) {
     // check for the connection 
     for (int i = 0; i < MAX_SOCK_NUM; i++) {
       if (c == client[i]) { // existing connection
         *clientId = i;
-        if (status[i] == OPEN) {
-          if (client[*clientId].available()) {
-            opcode = readFrame(payloadData, &payloadLength, *clientId);
-            switch (opcode) {
-              case WS_FRAME_TEXT:
-              case WS_FRAME_BINARY:
-                if (onMessage) {
-                  onMessage(payloadData, payloadLength, *clientId);
-                }
-                return WS_DATA_RECEIVCED;
-              case WS_FRAME_CLOSE :
-                if (onClose) {
-                  onClose(*clientId);
-                }
-                sendClose(WS_CLOSE_NORMAL, *clientId);
-                client[*clientId].stop();
-                return WS_CLOSED;
-              default: // got unsupported or unknown message
-                retval = WS_PROTOCOL_ERROR;
-                goto wsAvailableError;
-            }
-          } else {  // server is available but client is not available
-            retval = WS_STATUS_MISMATCH;
-            goto wsAvailableError;
-          }
-        } else { // status is not OPENl
-          retval = WS_STATUS_MISMATCH;
-          goto wsAvailableError;
-        }
+        retval = receive(i);
+        WS_CAPTURE(capture.flush());
+        return retval;
       }
     }
     
@@ -71,24 +295,198 @@ int WebSocket::available(int *clientId) {
       if (status[i] == CLOSED) {
         *clientId = i;
         client[i] = c;
-        if (handshake(requestURI, *clientId) == WS_OK) {
-          if (onOpen) {
-            onOpen(requestURI, *clientId);
-          }
-          status[*clientId] = OPEN;
-          return WS_CONNECTED;
-        } else {
-          status[*clientId] = CLOSED;
-          return WS_ERROR;
-        }
+        retval = accept(i);
+        WS_CAPTURE(capture.flush());
+        return retval;
       }
     }
     
-    wsAvailableError:
     if (onError) {
       onError(*clientId);
     }
-    return retval;
+    return WS_ERROR;
+  }
+
+  return WS_NO_CLIENT;
+}
+
+// Every read and write on a connection goes through here, so that it can be captured.
+Client &WebSocket::io(int clientId) {
+#if WS_USE_CAPTURE
+  return transport[clientId];
+#else
+  return client[clientId];
+#endif
+}
+
+// Reads and dispatches one frame from an open connection.
+int WebSocket::receive(int clientId) {
+  char payloadData[WS_MAX_PAYLOAD_LENGTH + 1];
+#if WS_USE_DEFLATE
+  char inflated[WS_MAX_PAYLOAD_LENGTH];
+#endif
+  int payloadLength = 0;
+  int opcode;
+  int retval = WS_ERROR;
+#if WS_USE_STATS
+  unsigned long start;
+#endif
+
+  if (status[clientId] == OPEN) {
+    if (io(clientId).available()) {
+      WS_STAT(start = micros());
+      opcode = wsReadFrame(io(clientId), payloadData, &payloadLength);
+#if WS_USE_STATS
+      // Only frames that decoded count. Client frames are always masked, so a short frame has a six byte header.
+      if (opcode >= 0) {
+        stats.client[clientId].framesIn++;
+        stats.client[clientId].bytesIn += WS_HEADER_LENGTH + WS_MASK_LENGTH + payloadLength;
+      }
+#endif
+#if WS_USE_DEFLATE
+      if (opcode > 0 && (opcode & WS_FRAME_RSV1) && windowBits[clientId]) {
+        payloadLength = deflateDecode(&deflateArena, (uint8_t *)payloadData, payloadLength, (uint8_t *)inflated, WS_MAX_PAYLOAD_LENGTH);
+        if (payloadLength < 0) {
+          opcode = WS_NOT_SUPPORTED;
+        } else {
+          memcpy(payloadData, inflated, payloadLength);
+          payloadData[payloadLength] = '\0';
+          opcode &= ~WS_FRAME_RSV1;
+        }
+      }
+#endif
+      switch (opcode) {
+        case WS_FRAME_TEXT:
+        case WS_FRAME_BINARY:
+#if WS_USE_STATS
+          if (statsClients & (1 << clientId)) {
+            sendStats(clientId);
+            return WS_DATA_RECEIVCED;
+          }
+#endif
+          if (route[clientId] != WS_NO_ROUTE) {
+            if (routes[route[clientId]].handler) {
+              routes[route[clientId]].handler->onMessage(payloadData, payloadLength, clientId);
+            } else if (routes[route[clientId]].onMessage) {
+              routes[route[clientId]].onMessage(payloadData, payloadLength, clientId);
+            }
+          } else if (onMessage) {
+            onMessage(payloadData, payloadLength, clientId);
+          }
+          WS_STAT(recordDuration(stats.dispatchTime, micros() - start));
+          return WS_DATA_RECEIVCED;
+        case WS_FRAME_CLOSE :
+#if WS_OUTPUT_BUFFER_SIZE > 0
+          // The peer is closing and will not read queued data; answer ahead of it, keeping only a partly written frame.
+          output[clientId]->length = output[clientId]->frameRemaining;
+          for (int j = 0; j < WS_LATEST_SLOTS; j++) {
+            output[clientId]->latest[j] = -1;
+          }
+          if (output[clientId]->prepared && !output[clientId]->preparedSent) {
+            output[clientId]->prepared->references--;
+            output[clientId]->prepared = NULL;
+          }
+#endif
+          if (route[clientId] != WS_NO_ROUTE) {
+            if (routes[route[clientId]].handler) {
+              routes[route[clientId]].handler->onClose(clientId);
+            } else if (routes[route[clientId]].onClose) {
+              routes[route[clientId]].onClose(clientId);
+            }
+          } else if (onClose) {
+            onClose(clientId);
+          }
+          // The handler may have answered the close itself, which releases the slot.
+          if (status[clientId] == OPEN) {
+            sendClose(WS_CLOSE_NORMAL, clientId);
+          }
+          io(clientId).stop();
+          return WS_CLOSED;
+        case WS_FRAME_PING:
+          sendPayload((uint8_t *)payloadData, payloadLength, WS_FRAME_PONG, clientId);
+          return WS_NO_DATA;
+        case WS_FRAME_PONG:
+          return WS_NO_DATA;
+        default: // got unsupported or unknown message
+          WS_STAT(stats.client[clientId].protocolErrors++);
+          retval = WS_PROTOCOL_ERROR;
+          break;
+      }
+    } else {  // server is available but client is not available
+      retval = WS_STATUS_MISMATCH;
+    }
+  } else { // status is not OPEN
+    retval = WS_STATUS_MISMATCH;
+  }
+
+  if (onError) {
+    onError(clientId);
+  }
+  return retval;
+}
+
+// Runs the opening handshake on a closed slot and opens the connection.
+int WebSocket::accept(int clientId) {
+  char requestURI[WS_MAX_LINE_LENGTH];
+  int protocol;
+  int retval;
+#if WS_USE_STATS
+  unsigned long start;
+#endif
+
+  WS_STAT(start = micros());
+  if ((retval = acquire(clientId)) == WS_OK && (retval = handshake(requestURI, &protocol, clientId)) == WS_OK) {
+    WS_STAT(recordDuration(stats.handshakeTime, micros() - start));
+    WS_STAT(memset(&stats.client[clientId], 0, sizeof(wsClientStats)));
+#if WS_USE_STATS
+    if (strcmp(requestURI, WS_STATS_URI) == 0) {
+      statsClients |= (wsClientMask)(1 << clientId);
+      status[clientId] = OPEN;
+      sendStats(clientId);
+      return WS_CONNECTED;
+    }
+#endif
+    // Open before the callback so that it can already send.
+    status[clientId] = OPEN;
+    if (route[clientId] != WS_NO_ROUTE) {
+      if (routes[route[clientId]].handler) {
+        routes[route[clientId]].handler->onOpen(requestURI, protocol, clientId);
+      } else if (routes[route[clientId]].onOpen) {
+        routes[route[clientId]].onOpen(requestURI, protocol, clientId);
+      }
+    } else if (onOpen) {
+      onOpen(requestURI, protocol, clientId);
+    }
+    return WS_CONNECTED;
+  } else {
+#if WS_USE_STATS
+    stats.handshakeFailures[handshakeFailure(retval)]++;
+#endif
+    release(clientId);
+    io(clientId).stop();
+    return WS_ERROR;
+  }
+}
+
+int WebSocket::waitForEvent(unsigned long timeout) {
+  unsigned long start = millis();
+  // A due flush deadline counts as an event: available() is what writes it out.
+  unsigned long deadline = nextDeadline(timeout);
+
+  for (;;) {
+    if (server.available()) {
+      return WS_OK;
+    }
+#if WS_USE_SUBMIT_QUEUE
+    // Something posted from another thread or an interrupt wakes us like incoming data does.
+    if (wsQueuePeek(&submitted)) {
+      return WS_OK;
+    }
+#endif
+    if (millis() - start >= deadline) {
+      return deadline < timeout ? WS_OK : WS_NO_DATA;
+    }
+    idle();
   }
 }
 
@@ -101,44 +499,1045 @@ int WebSocket::sendBinary(uint8_t *data, uint8_t dataLength, int clientId) {
 }
 
 int WebSocket::sendPayload(uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode, int clientId) {
+  uint8_t frame[WS_HEADER_LENGTH + WS_MAX_PAYLOAD_LENGTH];
+  int frameLength;
+
   if (status[clientId] == OPEN) {
-    if (payloadLength > WS_MAX_PAYLOAD_LENGTH) {
-      return WS_LINE_TOO_LONG;
+    if ((frameLength = encodePayload(frame, payLoadData, payloadLength, opcode, clientId)) < 0) {
+      return frameLength;
     }
+    return writeFrame(frame, frameLength, clientId);
+  } else {
+    return WS_STATUS_MISMATCH;
+  }
+}
+
+/*
+ * Frames payload once into storage, which needs WS_MAX_HEADER_LENGTH bytes
+ * more than the payload, plus room for a compressed copy when deflate is
+ * compiled in. The message can then go to any number of clients with
+ * sendPrepared(), as often as needed, without being encoded or copied
+ * again. message must start zeroed; it cannot be prepared again while
+ * references says it is still queued somewhere.
+ */
+int WebSocket::prepare(wsPreparedMessage *message, uint8_t *storage, uint16_t storageLength, const uint8_t *payload, uint16_t payloadLength, uint8_t opcode) {
+  int headerLength;
+#if WS_USE_DEFLATE
+  uint8_t *compressed;
+  int room;
+  int compressedLength;
+#endif
+
+  if (message->references) {
+    return WS_STATUS_MISMATCH;
+  }
+  if (storageLength < WS_MAX_HEADER_LENGTH + payloadLength) {
+    return WS_ERROR;
+  }
+  headerLength = wsEncodeHeader(storage, payloadLength, opcode);
+  memcpy(storage + headerLength, payload, payloadLength);
+  message->frame = storage;
+  message->frameLength = headerLength + payloadLength;
+  message->compressed = NULL;
+  message->compressedLength = 0;
 
-    client[clientId].write(WS_FRAME_FIN | opcode);
-    client[clientId].write(payloadLength & 0x7f);
+#if WS_USE_DEFLATE
+  // The smallest window makes one variant good for every server_max_window_bits a client may have negotiated.
+  compressed = storage + message->frameLength + 4;
+  room = storageLength - message->frameLength - 4;
+  if (payloadLength <= DEFLATE_MAX_INPUT && room > 0 && !(opcode & WS_FRAME_CONTROL)) {
+    compressedLength = deflateEncode(&deflateArena, payload, payloadLength, compressed, room < payloadLength - 1 ? room : payloadLength - 1, 1 << 8);
+    if (compressedLength > 0) {
+      headerLength = compressedLength <= WS_MAX_PAYLOAD_LENGTH ? WS_HEADER_LENGTH : 4;
+      wsEncodeHeader(compressed - headerLength, compressedLength, opcode | WS_FRAME_RSV1);
+      message->compressed = compressed - headerLength;
+      message->compressedLength = headerLength + compressedLength;
+    }
+  }
+#endif
+  return WS_OK;
+}
+
+/*
+ * Queues a reference to message, not a copy; it is written from its own
+ * storage as the transport takes it, ahead of anything sent afterwards.
+ * A client holds one prepared message at a time, behind nothing: if
+ * frames or an earlier message are still waiting, they are flushed
+ * first, which blocks until the transport takes them. A rate-limited
+ * client is not flushed past its limit; it gets WS_RATE_LIMITED and the
+ * caller retries once available() has drained its queue.
+ */
+int WebSocket::sendPrepared(wsPreparedMessage *message, int clientId) {
+  const uint8_t *frame = message->frame;
+  uint16_t frameLength = message->frameLength;
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out;
+#endif
 
-    for (int i = 0; i < payloadLength; i++) {
-      client[clientId].write(payLoadData[i]);
+  if (clientId == WS_SENDTO_ALL) {
+    for (int i = 0; i < MAX_SOCK_NUM; i++) {
+      if (status[i] == OPEN) {
+        sendPrepared(message, i);
+      }
     }
     return WS_OK;
-  } else {
+  }
+  if (status[clientId] != OPEN) {
     return WS_STATUS_MISMATCH;
   }
+
+#if WS_USE_DEFLATE
+  if (message->compressedLength && windowBits[clientId] && !(compressionDisabled & (1 << clientId))) {
+    frame = message->compressed;
+    frameLength = message->compressedLength;
+  }
+#endif
+
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  out = output[clientId];
+  // Only one message can be referenced at a time, and whatever was queued before it goes first.
+  drain(clientId);
+  if (out->length || out->prepared) {
+    if (shaper[clientId].rate || globalShaper.rate) {
+      WS_STAT(stats.client[clientId].rateLimited++);
+      return WS_RATE_LIMITED;
+    }
+    flush(clientId);
+  }
+  if (out->controlLength == 0) {
+    out->queuedAt = micros();
+  }
+  out->prepared = message;
+  out->preparedFrame = frame;
+  out->preparedLength = frameLength;
+  out->preparedSent = 0;
+  message->references++;
+  if (!flushDeadline) {
+    drain(clientId);
+  }
+#else
+  io(clientId).write(frame, frameLength);
+#endif
+  WS_STAT(stats.client[clientId].framesOut++);
+  WS_STAT(stats.client[clientId].bytesOut += frameLength);
+  return WS_OK;
+}
+
+/*
+ * Like sendPayload, but a frame sent earlier with the same slot that is
+ * still waiting in the output buffer is overwritten instead of followed.
+ * A client that keeps up sees every update; one that does not gets only
+ * the newest value, without the queue growing.
+ */
+int WebSocket::sendLatest(uint8_t slot, uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode, int clientId) {
+  uint8_t frame[WS_HEADER_LENGTH + WS_MAX_PAYLOAD_LENGTH];
+  int frameLength;
+
+  if (clientId == WS_SENDTO_ALL) {
+    for (int i = 0; i < MAX_SOCK_NUM; i++) {
+      if (status[i] == OPEN) {
+        sendLatest(slot, payLoadData, payloadLength, opcode, i);
+      }
+    }
+    return WS_OK;
+  }
+
+  if (slot >= WS_LATEST_SLOTS) {
+    return WS_INVALID_TOPIC;
+  }
+  if (status[clientId] != OPEN) {
+    return WS_STATUS_MISMATCH;
+  }
+  if ((frameLength = encodePayload(frame, payLoadData, payloadLength, opcode, clientId)) < 0) {
+    return frameLength;
+  }
+  return replaceFrame(slot, frame, frameLength, clientId);
 }
 
 int WebSocket::sendClose(uint16_t statusCode, int clientId) {
+  uint8_t frame[WS_HEADER_LENGTH + 2];
+  uint8_t code[2];
+
   if (status[clientId] == OPEN) {
-    client[clientId].write(WS_FRAME_FIN | WS_FRAME_CLOSE);
-    client[clientId].write((uint8_t)(statusCode >> 8));
-    client[clientId].write((uint8_t)(statusCode & 0xff));
-    status[clientId] = CLOSED;
+    code[0] = (uint8_t)(statusCode >> 8);
+    code[1] = (uint8_t)(statusCode & 0xff);
+    // Data the application queued before closing goes out first; nothing may follow the close frame.
+    flush(clientId);
+    writeFrame(frame, wsEncodeFrame(frame, code, 2, WS_FRAME_CLOSE), clientId);
+    flush(clientId);
+    release(clientId);
     return WS_OK;
   } else {
     return WS_STATUS_MISMATCH;
   }
 }
 
-int WebSocket::handshake(char * requestURI, int clientId) {
+// Forgets everything attached to a slot so the next connection starts clean.
+void WebSocket::release(int clientId) {
+  status[clientId] = CLOSED;
+#if WS_USE_DEFLATE
+  windowBits[clientId] = 0;
+  compressionDisabled &= ~(wsClientMask)(1 << clientId);
+#endif
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  if (output[clientId]) {
+    if (output[clientId]->prepared) {
+      output[clientId]->prepared->references--;
+    }
+    freeBlocks[numFree++] = output[clientId] - blocks;
+    output[clientId] = NULL;
+  }
+#endif
+  WS_STAT(statsClients &= ~(wsClientMask)(1 << clientId));
+  for (int i = 0; i < WS_MAX_TOPICS; i++) {
+    subscribers[i] &= ~(wsClientMask)(1 << clientId);
+  }
+}
+
+int WebSocket::sendPing(uint8_t *payLoadData, uint8_t payloadLength, int clientId) {
+  return sendPayload(payLoadData, payloadLength, WS_FRAME_PING, clientId);
+}
+
+/*
+ * Sends length bytes read from source as a single frame with an extended
+ * length, one chunk at a time, so the message never has to fit in RAM.
+ */
+int WebSocket::sendStream(Stream &source, uint32_t length, uint8_t opcode, int clientId) {
+  uint8_t buffer[WS_STREAM_CHUNK_SIZE];
+  uint32_t remaining;
+  int chunk;
+
+  if (status[clientId] != OPEN) {
+    return WS_STATUS_MISMATCH;
+  }
+
+  flush(clientId);
+  chunk = wsEncodeHeader(buffer, length, opcode);
+  spend(chunk + length, clientId);
+  io(clientId).write(buffer, chunk);
+  WS_STAT(stats.client[clientId].framesOut++);
+  WS_STAT(stats.client[clientId].bytesOut += chunk + length);
+
+  for (remaining = length; remaining; remaining -= chunk) {
+    chunk = remaining < streamChunkSize ? remaining : streamChunkSize;
+    if ((int)source.readBytes(buffer, chunk) != chunk) {
+      // The frame header promised more than the source had; the connection cannot be recovered.
+      io(clientId).stop();
+      release(clientId);
+      return WS_ERROR;
+    }
+    io(clientId).write(buffer, chunk);
+  }
+  return WS_OK;
+}
+
+/*
+ * Sends a message of any length straight from the caller's memory: the
+ * header and then data itself go to the transport, with no copy through a
+ * stack or output buffer. Messages that fit a short frame take the usual
+ * path instead, where they can be batched and compressed.
+ */
+int WebSocket::sendBuffer(const uint8_t *data, uint32_t length, uint8_t opcode, int clientId) {
+  uint8_t header[WS_MAX_HEADER_LENGTH];
+  int headerLength;
+
+  if (length <= WS_MAX_PAYLOAD_LENGTH) {
+    return sendPayload((uint8_t *)data, length, opcode, clientId);
+  }
+  if (status[clientId] != OPEN) {
+    return WS_STATUS_MISMATCH;
+  }
+
+  flush(clientId);
+  headerLength = wsEncodeHeader(header, length, opcode);
+  spend(headerLength + length, clientId);
+  io(clientId).write(header, headerLength);
+  io(clientId).write(data, length);
+  WS_STAT(stats.client[clientId].framesOut++);
+  WS_STAT(stats.client[clientId].bytesOut += headerLength + length);
+  return WS_OK;
+}
+
+/*
+ * Sends whatever read() produces as a fragmented message: one frame per
+ * chunk, closed by an empty final continuation frame once read() returns 0.
+ * Control frames may be sent between the fragments.
+ */
+int WebSocket::sendStream(streamRead_t read, void *context, uint8_t opcode, int clientId) {
+  uint8_t buffer[WS_MAX_HEADER_LENGTH + WS_STREAM_CHUNK_SIZE];
+  uint8_t *chunk = buffer + WS_MAX_HEADER_LENGTH;
+  int chunkLength;
+  int headerLength;
+
+  if (status[clientId] != OPEN) {
+    return WS_STATUS_MISMATCH;
+  }
+
+  flush(clientId);
+  do {
+    if ((chunkLength = read(chunk, streamChunkSize, context)) < 0) {
+      chunkLength = 0;
+    }
+    headerLength = wsEncodeHeader(buffer, chunkLength, opcode, NULL, chunkLength == 0);
+    memmove(chunk - headerLength, buffer, headerLength);
+    io(clientId).write(chunk - headerLength, headerLength + chunkLength);
+    spend(headerLength + chunkLength, clientId);
+    WS_STAT(stats.client[clientId].framesOut++);
+    WS_STAT(stats.client[clientId].bytesOut += headerLength + chunkLength);
+    opcode = WS_FRAME_CONTINUATION;
+  } while (chunkLength > 0);
+  return WS_OK;
+}
+
+void WebSocket::setStreamChunkSize(uint16_t chunkSize) {
+  if (chunkSize == 0 || chunkSize > WS_STREAM_CHUNK_SIZE) {
+    chunkSize = WS_STREAM_CHUNK_SIZE;
+  }
+  streamChunkSize = chunkSize;
+}
+
+/*
+ * Connections whose request URI starts with path are handed to these
+ * handlers instead of the ones given to the constructor. The longest
+ * matching path wins; once any route exists, other URIs get a 404.
+ * path is not copied and must stay valid.
+ */
+int WebSocket::addRoute(const char *path, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose) {
+  if (numRoutes >= WS_MAX_ROUTES) {
+    return WS_ERROR;
+  }
+  routes[numRoutes].path = path;
+  routes[numRoutes].pathLength = strlen(path);
+  routes[numRoutes].onOpen = onOpen;
+  routes[numRoutes].onMessage = onMessage;
+  routes[numRoutes].onClose = onClose;
+  routes[numRoutes].handler = NULL;
+  return numRoutes++;
+}
+
+int WebSocket::addRoute(const char *path, WebSocketRoute *handler) {
+  int index = addRoute(path, NULL, NULL, NULL);
+
+  if (index >= 0) {
+    routes[index].handler = handler;
+  }
+  return index;
+}
+
+int WebSocket::subscribe(uint8_t topic, int clientId) {
+  if (topic >= WS_MAX_TOPICS) {
+    return WS_INVALID_TOPIC;
+  }
+  if (status[clientId] != OPEN) {
+    return WS_STATUS_MISMATCH;
+  }
+  subscribers[topic] |= (wsClientMask)(1 << clientId);
+  return WS_OK;
+}
+
+int WebSocket::unsubscribe(uint8_t topic, int clientId) {
+  if (topic >= WS_MAX_TOPICS) {
+    return WS_INVALID_TOPIC;
+  }
+  subscribers[topic] &= ~(wsClientMask)(1 << clientId);
+  return WS_OK;
+}
+
+int WebSocket::publish(uint8_t topic, uint8_t *data, uint8_t dataLength, uint8_t opcode) {
+  uint8_t frame[WS_HEADER_LENGTH + WS_MAX_PAYLOAD_LENGTH];
+  int frameLength;
+  wsClientMask mask;
+
+  if (topic >= WS_MAX_TOPICS) {
+    return WS_INVALID_TOPIC;
+  }
+  if ((frameLength = wsEncodeFrame(frame, data, dataLength, opcode)) < 0) {
+    return frameLength;
+  }
+
+  // The frame is encoded once and the same bytes go to every subscriber.
+  mask = subscribers[topic];
+  for (int i = 0; mask; i++, mask >>= 1) {
+    if ((mask & 1) && status[i] == OPEN) {
+      writeFrame(frame, frameLength, i);
+    }
+  }
+  return WS_OK;
+}
+
+void WebSocket::setBatching(unsigned long flushDeadline) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  if (flushDeadline == 0) {
+    flush(WS_SENDTO_ALL);
+  }
+  this->flushDeadline = flushDeadline;
+#endif
+}
+
+/*
+ * Limits how fast queued data frames are written to a client, to
+ * bytesPerSecond with bursts of up to burst bytes; 0 removes the limit.
+ * burst is raised to WS_OUTPUT_BUFFER_SIZE if it is smaller.
+ * Frames over the limit wait in the output buffer. Control frames, and
+ * writes that cannot wait (flush(), oversized frames), go out at once
+ * and are paid for afterwards.
+ */
+void WebSocket::setRateLimit(uint32_t bytesPerSecond, uint16_t burst, int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  if (clientId == WS_SENDTO_ALL) {
+    for (int i = 0; i < MAX_SOCK_NUM; i++) {
+      setRateLimit(bytesPerSecond, burst, i);
+    }
+    return;
+  }
+  setBucket(&shaper[clientId], bytesPerSecond, burst);
+#endif
+}
+
+// Like setRateLimit, but for the total written to all clients together.
+void WebSocket::setGlobalRateLimit(uint32_t bytesPerSecond, uint16_t burst) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  setBucket(&globalShaper, bytesPerSecond, burst);
+#endif
+}
+
+/*
+ * Calls callback with clientId from available() once delay milliseconds
+ * have passed, and makes waitForEvent() wake up for it. timer is owned by
+ * the caller, must start zeroed (a global or static will do) and must stay
+ * valid until it fires or is cancelled; scheduling it again moves it.
+ */
+void WebSocket::schedule(wsTimer *timer, unsigned long delay, onTimer_t callback, int clientId) {
+  timer->callback = callback;
+  timer->clientId = clientId;
+  wsTimerSchedule(&timers, timer, millis() + delay);
+}
+
+void WebSocket::cancel(wsTimer *timer) {
+  wsTimerCancel(timer);
+}
+
+#if WS_USE_SUBMIT_QUEUE
+/*
+ * The one call that is safe from any thread or interrupt handler: copies
+ * the message into the submission queue without blocking, to be sent by
+ * the next available(). clientId may be WS_SENDTO_ALL. Returns
+ * WS_QUEUE_FULL instead of waiting when there is no room.
+ */
+int WebSocket::post(int clientId, const uint8_t *data, uint8_t dataLength, uint8_t opcode) {
+  if (clientId < WS_SENDTO_ALL || clientId >= MAX_SOCK_NUM) {
+    return WS_STATUS_MISMATCH;
+  }
+  return wsQueuePost(&submitted, clientId, data, dataLength, opcode) ? WS_OK : WS_QUEUE_FULL;
+}
+
+// Sends what was posted since the last call, at most one queue's worth so that producers cannot starve the loop.
+void WebSocket::sendSubmitted() {
+  wsSubmission *entry;
+
+  for (int i = 0; i < WS_SUBMIT_QUEUE_LENGTH && (entry = wsQueuePeek(&submitted)); i++) {
+    if (entry->clientId == WS_SENDTO_ALL) {
+      for (int j = 0; j < MAX_SOCK_NUM; j++) {
+        if (status[j] == OPEN) {
+          sendPayload(entry->payload, entry->payloadLength, entry->opcode, j);
+        }
+      }
+    } else if (status[entry->clientId] == OPEN) {
+      sendPayload(entry->payload, entry->payloadLength, entry->opcode, entry->clientId);
+    }
+    wsQueuePop(&submitted);
+  }
+}
+#endif
+
+void WebSocket::setCompression(bool enabled, int clientId) {
+#if WS_USE_DEFLATE
+  if (enabled) {
+    compressionDisabled &= ~(wsClientMask)(1 << clientId);
+  } else {
+    compressionDisabled |= (wsClientMask)(1 << clientId);
+  }
+#endif
+}
+
+int WebSocket::flush(int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  if (clientId == WS_SENDTO_ALL) {
+    for (int i = 0; i < MAX_SOCK_NUM; i++) {
+      flush(i);
+    }
+    return WS_OK;
+  }
+
+  wsOutputBuffer *out = output[clientId];
+
+  if (!out) {
+    return WS_OK;
+  }
+  spend(out->length + out->controlLength, clientId);
+  if (out->frameRemaining) {
+    io(clientId).write(out->data, out->frameRemaining);
+    consumed(out->frameRemaining, clientId);
+  }
+  if (out->prepared && out->preparedSent) {
+    spend(writePrepared(out->preparedLength, clientId), clientId);
+  }
+  if (out->controlLength) {
+    io(clientId).write(out->control, out->controlLength);
+    out->controlLength = 0;
+  }
+  if (out->prepared) {
+    spend(writePrepared(out->preparedLength, clientId), clientId);
+  }
+  if (out->length) {
+    io(clientId).write(out->data, out->length);
+    consumed(out->length, clientId);
+  }
+#endif
+  return WS_OK;
+}
+
+/*
+ * Writes only what the transport can take without blocking: first the rest
+ * of a partly written frame, then the control lane, then a prepared message,
+ * then queued data. Data is also held to what the rate limits allow;
+ * control frames are not.
+ */
+void WebSocket::drain(int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out = output[clientId];
+  int room = io(clientId).availableForWrite();
+  int32_t allowed = allowance(clientId);
+  int length;
+
+  if (!out) {
+    return;
+  }
+  // A transport with no room is tried again a deadline later, not on every pass of the loop.
+  if (room <= 0) {
+    out->queuedAt = micros();
+    return;
+  }
+
+  if (out->frameRemaining) {
+    length = out->frameRemaining < room ? out->frameRemaining : room;
+    length = length < allowed ? length : allowed;
+    if (length > 0) {
+      length = io(clientId).write(out->data, length);
+      consumed(length, clientId);
+      spend(length, clientId);
+      room -= length;
+      allowed -= length;
+    }
+    if (out->frameRemaining) {
+      return;
+    }
+  }
+
+  if (out->prepared && out->preparedSent) {
+    length = writePrepared(room < allowed ? room : allowed, clientId);
+    spend(length, clientId);
+    room -= length;
+    allowed -= length;
+    if (out->prepared) {
+      return;
+    }
+  }
+
+  if (out->controlLength) {
+    length = out->controlLength < room ? out->controlLength : room;
+    if (length > 0) {
+      length = io(clientId).write(out->control, length);
+      out->controlLength -= length;
+      memmove(out->control, out->control + length, out->controlLength);
+      spend(length, clientId);
+      room -= length;
+    }
+    if (out->controlLength) {
+      return;
+    }
+  }
+
+  if (out->prepared) {
+    length = writePrepared(room < allowed ? room : allowed, clientId);
+    spend(length, clientId);
+    room -= length;
+    allowed -= length;
+    if (out->prepared) {
+      return;
+    }
+  }
+
+  length = out->length < room ? out->length : room;
+  length = length < allowed ? length : allowed;
+  if (length > 0) {
+    length = io(clientId).write(out->data, length);
+    consumed(length, clientId);
+    spend(length, clientId);
+  }
+#endif
+}
+
+// Writes up to limit bytes of the prepared message and lets go of it once it is all out.
+int WebSocket::writePrepared(int limit, int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out = output[clientId];
+  int length = out->preparedLength - out->preparedSent;
+
+  length = length < limit ? length : limit;
+  if (length <= 0) {
+    return 0;
+  }
+  length = io(clientId).write(out->preparedFrame + out->preparedSent, length);
+  out->preparedSent += length;
+  if (out->preparedSent == out->preparedLength) {
+    out->prepared->references--;
+    out->prepared = NULL;
+  }
+  return length;
+#else
+  return 0;
+#endif
+}
+
+// Bytes of queued data the client's and the global rate limits let through now.
+int32_t WebSocket::allowance(int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsTokenBucket *bucket = &shaper[clientId];
+  int32_t allowed = 0x7fff;
+
+  refill(bucket);
+  refill(&globalShaper);
+  if (bucket->rate && bucket->tokens < allowed) {
+    allowed = bucket->tokens;
+  }
+  if (globalShaper.rate && globalShaper.tokens < allowed) {
+    allowed = globalShaper.tokens;
+  }
+  return allowed;
+#else
+  return 0x7fff;
+#endif
+}
+
+void WebSocket::spend(int length, int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  if (shaper[clientId].rate) {
+    shaper[clientId].tokens -= length;
+  }
+  if (globalShaper.rate) {
+    globalShaper.tokens -= length;
+  }
+#endif
+}
+
+// Drops the first length bytes of the output buffer once they have been written.
+void WebSocket::consumed(int length, int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out = output[clientId];
+  int boundary = out->frameRemaining;
+
+  // Find where the frame the write stopped in ends.
+  while (boundary < length) {
+    boundary += queuedFrameLength(out->data + boundary);
+  }
+  out->frameRemaining = boundary - length;
+
+  out->length -= length;
+  memmove(out->data, out->data + length, out->length);
+  for (int i = 0; i < WS_LATEST_SLOTS; i++) {
+    // A frame that has started going out can no longer be replaced.
+    out->latest[i] = out->latest[i] < length ? -1 : out->latest[i] - length;
+  }
+  if (out->length) {
+    out->queuedAt = micros();
+  }
+#endif
+}
+
+int WebSocket::encodePayload(uint8_t *frame, uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode, int clientId) {
+#if WS_USE_DEFLATE
+  int compressedLength;
+
+  // Messages that do not get smaller are sent as they are, with RSV1 clear.
+  if (windowBits[clientId] && !(compressionDisabled & (1 << clientId)) && !(opcode & WS_FRAME_CONTROL)) {
+    compressedLength = deflateEncode(&deflateArena, payLoadData, payloadLength, frame + WS_HEADER_LENGTH, payloadLength - 1, 1 << windowBits[clientId]);
+    if (compressedLength > 0) {
+      return wsEncodeHeader(frame, compressedLength, opcode | WS_FRAME_RSV1) + compressedLength;
+    }
+  }
+#endif
+  return wsEncodeFrame(frame, payLoadData, payloadLength, opcode);
+}
+
+int WebSocket::writeFrame(uint8_t *frame, int frameLength, int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out = output[clientId];
+
+  // A rate-limited client may not catch up by blocking; when its queue is full the caller has to retry or drop.
+  if (!(frame[0] & WS_FRAME_CONTROL) && frameLength <= WS_OUTPUT_BUFFER_SIZE && out->length + frameLength > WS_OUTPUT_BUFFER_SIZE) {
+    drain(clientId);
+    if (out->length + frameLength > WS_OUTPUT_BUFFER_SIZE && allowance(clientId) <= 0) {
+      WS_STAT(stats.client[clientId].rateLimited++);
+      return WS_RATE_LIMITED;
+    }
+  }
+#endif
+
+  WS_STAT(stats.client[clientId].framesOut++);
+  WS_STAT(stats.client[clientId].bytesOut += frameLength);
+
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  if ((frame[0] & WS_FRAME_CONTROL) && frameLength <= WS_CONTROL_BUFFER_SIZE) {
+    if (out->controlLength + frameLength > WS_CONTROL_BUFFER_SIZE) {
+      flush(clientId);
+    }
+    memcpy(out->control + out->controlLength, frame, frameLength);
+    out->controlLength += frameLength;
+    // Control frames do not wait for the batching deadline.
+    drain(clientId);
+    return WS_OK;
+  }
+
+  if (frameLength <= WS_OUTPUT_BUFFER_SIZE) {
+    if (out->length + frameLength > WS_OUTPUT_BUFFER_SIZE) {
+      drain(clientId);
+      if (out->length + frameLength > WS_OUTPUT_BUFFER_SIZE) {
+        flush(clientId);
+      }
+    }
+    if (out->length == 0) {
+      out->queuedAt = micros();
+    }
+    memcpy(out->data + out->length, frame, frameLength);
+    out->length += frameLength;
+    // Without batching, send what the transport takes now and keep the rest for available().
+    if (!flushDeadline) {
+      drain(clientId);
+    }
+    return WS_OK;
+  }
+
+  // Frames that do not fit are written directly, after anything queued before them.
+  flush(clientId);
+  spend(frameLength, clientId);
+#endif
+  io(clientId).write(frame, frameLength);
+  return WS_OK;
+}
+
+int WebSocket::replaceFrame(uint8_t slot, uint8_t *frame, int frameLength, int clientId) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *out = output[clientId];
+  int offset = out->latest[slot];
+  int oldLength;
+  int delta;
+  int retval;
+
+  if (offset >= 0) {
+    oldLength = queuedFrameLength(out->data + offset);
+    delta = frameLength - oldLength;
+    if (out->length + delta <= WS_OUTPUT_BUFFER_SIZE) {
+      // Overwrite in place, moving the frames queued after it if the size changed.
+      memmove(out->data + offset + frameLength, out->data + offset + oldLength, out->length - offset - oldLength);
+      memcpy(out->data + offset, frame, frameLength);
+      out->length += delta;
+      for (int i = 0; i < WS_LATEST_SLOTS; i++) {
+        if (out->latest[i] > offset) {
+          out->latest[i] += delta;
+        }
+      }
+      return WS_OK;
+    }
+    // No room to grow in place: drop the stale frame and queue the new one at the end.
+    memmove(out->data + offset, out->data + offset + oldLength, out->length - offset - oldLength);
+    out->length -= oldLength;
+    for (int i = 0; i < WS_LATEST_SLOTS; i++) {
+      if (out->latest[i] > offset) {
+        out->latest[i] -= oldLength;
+      }
+    }
+    out->latest[slot] = -1;
+  }
+
+  // A refused frame was not queued, so there is nothing for the slot to point at.
+  if ((retval = writeFrame(frame, frameLength, clientId)) != WS_OK) {
+    return retval;
+  }
+  if (frameLength <= WS_OUTPUT_BUFFER_SIZE && out->length >= frameLength) {
+    out->latest[slot] = out->length - frameLength;
+  }
+  return WS_OK;
+#else
+  return writeFrame(frame, frameLength, clientId);
+#endif
+}
+
+void WebSocket::flushExpired() {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  unsigned long now = micros();
+
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    if (output[i] && (output[i]->controlLength || ((output[i]->length || output[i]->prepared) && now - output[i]->queuedAt >= flushDeadline))) {
+      drain(i);
+    }
+  }
+#endif
+}
+
+#if WS_USE_STATS
+wsStats *WebSocket::getStats() {
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+    stats.client[i].queueDepth = 0;
+    if (output[i]) {
+      stats.client[i].queueDepth = output[i]->length + output[i]->controlLength;
+      if (output[i]->prepared) {
+        stats.client[i].queueDepth += output[i]->preparedLength - output[i]->preparedSent;
+      }
+    }
+    refill(&shaper[i]);
+    stats.client[i].tokens = shaper[i].rate ? shaper[i].tokens : 0;
+#else
+    stats.client[i].queueDepth = 0;
+    stats.client[i].tokens = 0;
+#endif
+  }
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  refill(&globalShaper);
+  stats.globalTokens = globalShaper.rate ? globalShaper.tokens : 0;
+#endif
+  return &stats;
+}
+
+void WebSocket::resetStats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+void WebSocket::sendStats(int clientId) {
+  uint8_t frame[WS_MAX_HEADER_LENGTH + WS_STATS_JSON_LENGTH];
+  char *json = (char *)frame + WS_MAX_HEADER_LENGTH;
+  int length;
+  int headerLength;
+  wsClientStats *c;
+
+  getStats();
+
+  // One message per open connection, then one with the server-wide histograms.
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    if (status[i] != OPEN) {
+      continue;
+    }
+    c = &stats.client[i];
+    length = snprintf(json, WS_STATS_JSON_LENGTH,
+      "{\"client\":%d,\"framesIn\":%lu,\"framesOut\":%lu,\"bytesIn\":%lu,\"bytesOut\":%lu,\"protocolErrors\":%u,\"queueDepth\":%u,\"rateLimited\":%u,\"tokens\":%ld}",
+      i, (unsigned long)c->framesIn, (unsigned long)c->framesOut, (unsigned long)c->bytesIn, (unsigned long)c->bytesOut,
+      (unsigned int)c->protocolErrors, (unsigned int)c->queueDepth, (unsigned int)c->rateLimited, (long)c->tokens);
+    headerLength = prependHeader((uint8_t *)json, length, WS_FRAME_TEXT);
+    writeFrame((uint8_t *)json - headerLength, headerLength + length, clientId);
+  }
+
+  length = snprintf(json, WS_STATS_JSON_LENGTH,
+    "{\"handshakeFailures\":{\"other\":%u,\"lineTooLong\":%u,\"statusMismatch\":%u,\"notSupported\":%u,\"notFound\":%u},\"handshakeTime\":[",
+    stats.handshakeFailures[WS_FAILED_OTHER], stats.handshakeFailures[WS_FAILED_LINE_TOO_LONG], stats.handshakeFailures[WS_FAILED_STATUS_MISMATCH],
+    stats.handshakeFailures[WS_FAILED_NOT_SUPPORTED], stats.handshakeFailures[WS_FAILED_NOT_FOUND]);
+  for (int i = 0; i < WS_HISTOGRAM_BUCKETS; i++) {
+    length += snprintf(json + length, WS_STATS_JSON_LENGTH - length, i ? ",%u" : "%u", stats.handshakeTime[i]);
+  }
+  length += snprintf(json + length, WS_STATS_JSON_LENGTH - length, "],\"dispatchTime\":[");
+  for (int i = 0; i < WS_HISTOGRAM_BUCKETS; i++) {
+    length += snprintf(json + length, WS_STATS_JSON_LENGTH - length, i ? ",%u" : "%u", stats.dispatchTime[i]);
+  }
+  length += snprintf(json + length, WS_STATS_JSON_LENGTH - length, "],\"globalTokens\":%ld}", (long)stats.globalTokens);
+  headerLength = prependHeader((uint8_t *)json, length, WS_FRAME_TEXT);
+  writeFrame((uint8_t *)json - headerLength, headerLength + length, clientId);
+}
+#endif
+
+#if WS_USE_CAPTURE
+// Records everything read from and written to the clients to sink; NULL stops recording.
+void WebSocket::setCapture(Print *sink) {
+  capture.flush();
+  capture.sink = sink;
+}
+
+/*
+ * Feeds a capture back through the same code available() runs, with every
+ * connection served from the capture and writes discarded. Received bytes
+ * go to the slot they were recorded on; a closed slot takes them as a new
+ * connection. With realTime the original spacing is kept, otherwise it runs
+ * as fast as it can. Meant for a WebSocket that is not serving clients.
+ */
+int WebSocket::replay(Stream &source, bool realTime) {
+  wsReplayClient replaying;
+  uint8_t header[WS_CAPTURE_HEADER_LENGTH];
+  unsigned long start = micros();
+  uint32_t first = 0;
+  uint32_t at;
+  int clientId = -1;
+  int recordClient;
+  int length;
+  int retval = WS_OK;
+  bool started = false;
+
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    transport[i].target = &replaying;
+  }
+
+  while ((length = source.readBytes(header, WS_CAPTURE_HEADER_LENGTH)) > 0) {
+    if (length < WS_CAPTURE_HEADER_LENGTH) {
+      retval = WS_ERROR;
+      break;
+    }
+    at = (uint32_t)header[0] | ((uint32_t)header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+    recordClient = header[4];
+    length = header[5] | (header[6] << 8);
+    if (!started) {
+      first = at;
+      started = true;
+    }
+
+    // What the library wrote is regenerated, not replayed; it only ends a run of received bytes.
+    if (recordClient != clientId) {
+      replayed(&replaying, clientId, false);
+      clientId = recordClient & WS_CAPTURE_SENT ? -1 : recordClient;
+    } else if (replaying.length + length > WS_REPLAY_BUFFER_SIZE) {
+      // A full buffer may end mid-frame; that tail waits for the rest unless it alone fills the buffer.
+      replayed(&replaying, clientId, true);
+      if (replaying.length + length > WS_REPLAY_BUFFER_SIZE) {
+        replayed(&replaying, clientId, false);
+      }
+    }
+    if (recordClient & WS_CAPTURE_SENT || recordClient >= MAX_SOCK_NUM || length > WS_REPLAY_BUFFER_SIZE) {
+      for (; length > 0; length--) {
+        source.read();
+      }
+      continue;
+    }
+
+    if (realTime) {
+      while (micros() - start < at - first) {
+      }
+    }
+    if ((int)source.readBytes(replaying.data + replaying.length, length) != length) {
+      retval = WS_ERROR;
+      break;
+    }
+    replaying.length += length;
+  }
+  replayed(&replaying, clientId, false);
+
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    if (status[i] != CLOSED) {
+      release(i);
+    }
+    transport[i].target = &client[i];
+  }
+  return retval;
+}
+
+// Whether data starts with a whole frame, or on a closed slot a whole request.
+static bool replayComplete(const uint8_t *data, int length, bool open) {
+  if (open) {
+    return length >= WS_HEADER_LENGTH && length >= WS_HEADER_LENGTH + (data[1] & WS_FRAME_MASK ? WS_MASK_LENGTH : 0) + (data[1] & 0x7f);
+  }
+  for (int i = 3; i < length; i++) {
+    if (memcmp(data + i - 3, "\r\n\r\n", 4) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Runs what has been collected for clientId through receive() or accept().
+ * With more, the client's bytes continue in the next run: an incomplete
+ * frame at the end is moved to the front of the buffer instead of being
+ * read short.
+ */
+void WebSocket::replayed(wsReplayClient *source, int clientId, bool more) {
+  int remaining;
+
+  while (clientId >= 0 && (remaining = source->available()) > 0) {
+    if (more && !replayComplete(source->data + source->position, remaining, status[clientId] == OPEN)) {
+      memmove(source->data, source->data + source->position, remaining);
+      source->length = remaining;
+      source->position = 0;
+      return;
+    }
+    if (status[clientId] == OPEN) {
+      receive(clientId);
+    } else {
+      accept(clientId);
+    }
+    if (source->available() == remaining) {
+      break;
+    }
+  }
+  source->length = 0;
+  source->position = 0;
+}
+#endif
+
+unsigned long WebSocket::nextDeadline(unsigned long timeout) {
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  unsigned long now = micros();
+  unsigned long remaining;
+  // Without batching, a backlog left by a slow client is retried every millisecond.
+  unsigned long deadline = flushDeadline ? flushDeadline : 1000;
+
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    if (!output[i]) {
+      continue;
+    } else if (output[i]->controlLength) {
+      remaining = 1;
+    } else if (output[i]->length || output[i]->prepared) {
+      remaining = now - output[i]->queuedAt >= deadline ? 0 : (deadline - (now - output[i]->queuedAt) + 999) / 1000;
+      // Data held back by a rate limit waits for tokens, not for the deadline.
+      refill(&shaper[i]);
+      refill(&globalShaper);
+      if (tokenWait(&shaper[i]) > remaining) {
+        remaining = tokenWait(&shaper[i]);
+      }
+      if (tokenWait(&globalShaper) > remaining) {
+        remaining = tokenWait(&globalShaper);
+      }
+    } else {
+      continue;
+    }
+    if (remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+#endif
+  return wsTimerNext(&timers, millis(), timeout);
+}
+
+void WebSocket::idle() {
+#ifdef __AVR__
+  // Idle mode keeps the timers and SPI running; the next interrupt (the millis() tick at the latest) wakes us.
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+#else
+  delay(1);
+#endif
+}
+
+/*
+ * Reads the request line and headers of an upgrade request from client.
+ * Returns the WS_HAS_* bits seen, or WS_LINE_TOO_LONG / WS_NOT_SUPPORTED.
+ * wsKey and requestURI need WS_MAX_LINE_LENGTH bytes each.
+ */
+int WebSocket::parseRequest(Client &client, char *requestURI, char *wsKey, int *protocol, int *deflateBits) {
   char buffer[WS_MAX_LINE_LENGTH];
-  char wsKey[WS_MAX_LINE_LENGTH];
-  char charRead;
-  int numRead = 0;
   uint8_t headerValidation = 0;
-  SHA1Context sha;
+  int matched;
+  int lineStatus;
 
-  while (readHTMLHeader((uint8_t *)buffer, WS_MAX_LINE_LENGTH, clientId) > 0) {
+  *protocol = WS_NO_PROTOCOL;
+  *deflateBits = 0;
+
+  while ((lineStatus = wsReadLine(client, buffer, WS_MAX_LINE_LENGTH)) > 0) {
     if (strncmp((char *)buffer, "GET", 3) == 0) {
       strtok((char *)buffer, " \t");
       strcpy(requestURI, strtok(NULL, " \t"));
@@ -153,7 +1552,18 @@ int WebSocket::handshake(char * requestURI, int clientId) {
     } else if (strncasecmp((char *)buffer, "connection:", 11) == 0) {
       headerValidation |= WS_HAS_CONNECTION;
     } else if (strncasecmp((char *)buffer, "sec-websocket-protocol:", 23) == 0) {
+      // The header may be repeated; keep the offer that ranks highest in our own list.
+      matched = matchProtocol((char *)buffer + 23);
+      if (matched != WS_NO_PROTOCOL && (*protocol == WS_NO_PROTOCOL || matched < *protocol)) {
+        *protocol = matched;
+      }
       headerValidation |= WS_HAS_SUBPROTOCOL;
+#if WS_USE_DEFLATE
+    } else if (strncasecmp((char *)buffer, "sec-websocket-extensions:", 25) == 0) {
+      if (!*deflateBits && (*deflateBits = matchDeflate((char *)buffer + 25))) {
+        headerValidation |= WS_HAS_DEFLATE;
+      }
+#endif
     } else if (strncasecmp((char *)buffer, "sec-websocket-key:", 18) == 0) {
       strtok((char *)buffer, " \t");
       strcpy((char *)wsKey, strtok(NULL, " \t"));
@@ -162,88 +1572,159 @@ int WebSocket::handshake(char * requestURI, int clientId) {
       strtok((char *)buffer, " \t");
       if (strncasecmp(strtok(NULL, " \t"), "13", 2) == 0) {
         headerValidation |= WS_HAS_SEC_WEBSOCKET_VERSION;
+      } else {
+        return WS_NOT_SUPPORTED;
       }
     }
   }
 
-  if (headerValidation == WS_HAS_ALL_HEADERS) {
+  if (lineStatus == WS_LINE_TOO_LONG) {
+    return WS_LINE_TOO_LONG;
+  }
+  return headerValidation;
+}
+
+int WebSocket::handshake(char *requestURI, int *protocol, int clientId) {
+  char buffer[WS_MAX_LINE_LENGTH];
+  char wsKey[WS_MAX_LINE_LENGTH];
+  int headerValidation;
+  int responseLength;
+  int deflateBits;
+  SHA1Context sha;
+
+  if ((headerValidation = parseRequest(io(clientId), requestURI, wsKey, protocol, &deflateBits)) < 0) {
+    return headerValidation;
+  }
+
+  if ((headerValidation & WS_HAS_GET) && (route[clientId] = matchRoute(requestURI)) == WS_NO_ROUTE && numRoutes
+#if WS_USE_STATS
+      && strcmp(requestURI, WS_STATS_URI) != 0
+#endif
+      ) {
+    io(clientId).write((const uint8_t *)WS_NOT_FOUND_RESPONSE, sizeof(WS_NOT_FOUND_RESPONSE) - 1);
+    return WS_NOT_FOUND;
+  }
+
+  // No response template means the arena was too small for it.
+  if (response && (headerValidation & WS_HAS_ALL_HEADERS) == WS_HAS_ALL_HEADERS) {
     strcat((char *)wsKey, WS_GUID);
     SHA1Reset(&sha);
     SHA1Input(&sha, (uint8_t *)wsKey, strlen(wsKey));
     SHA1Result(&sha, (uint8_t *)buffer);
-    buffer[20] = 0;
-
-    base64Encode(buffer, wsKey);
-    client[clientId].print("HTTP/1.1 101 Switching Protocols\r\n");
-    client[clientId].print("Upgrade: websocket\r\n");
-    client[clientId].print("Connection: Upgrade\r\n");
-    client[clientId].print("Sec-WebSocket-Accept: ");
-    client[clientId].print(wsKey);
-    client[clientId].print("\r\n");
-    if (headerValidation & WS_HAS_SUBPROTOCOL) {
-      client[clientId].print("Sec-WebSocket-Protocol: ");
-      client[clientId].print(supportedProtocol);
-      client[clientId].print("\r\n");
-    }
-    client[clientId].print("\r\n");
+
+    // Patch the Accept key into the pre-rendered response and append the selected protocol tail.
+    base64Encode((uint8_t *)buffer, SHA1HashSize, response + WS_RESPONSE_HEADER_LENGTH);
+    responseLength = WS_RESPONSE_HEADER_LENGTH + WS_ACCEPT_LENGTH;
+    memcpy(response + responseLength, "\r\n", 2);
+    responseLength += 2;
+#if WS_USE_DEFLATE
+    if (headerValidation & WS_HAS_DEFLATE) {
+      memcpy(response + responseLength, WS_EXTENSION_HEADER, sizeof(WS_EXTENSION_HEADER) - 1);
+      responseLength += sizeof(WS_EXTENSION_HEADER) - 1;
+      if (deflateBits >= 10) {
+        response[responseLength++] = '1';
+      }
+      response[responseLength++] = '0' + deflateBits % 10;
+      memcpy(response + responseLength, "\r\n", 2);
+      responseLength += 2;
+    }
+    windowBits[clientId] = deflateBits;
+#endif
+    if (*protocol != WS_NO_PROTOCOL) {
+      memcpy(response + responseLength, protocolLine[*protocol], WS_PROTOCOL_HEADER_LENGTH + protocolLength[*protocol] + 4);
+      responseLength += WS_PROTOCOL_HEADER_LENGTH + protocolLength[*protocol] + 4;
+    } else {
+      memcpy(response + responseLength, "\r\n", 2);
+      responseLength += 2;
+    }
+    io(clientId).write((uint8_t *)response, responseLength);
     return WS_OK;
   } else {
     return WS_ERROR;
   }
 }
 
-int WebSocket::readHTMLHeader(uint8_t * buffer, uint8_t bufferLength, int clientId) {
-  int dataRead;
-  int numRead = 0;
+#if WS_USE_DEFLATE
+/*
+ * Returns the window bits to use for the first acceptable permessage-deflate
+ * offer, or 0. Context takeover is always declined, so every message is
+ * compressed on its own and the arena never has to outlive a call.
+ */
+int WebSocket::matchDeflate(char *offered) {
+  char *offer;
+  char *parameter;
+  char *value;
+  char *offerState;
+  char *parameterState;
+  int bits;
 
-  while ((dataRead = client[clientId].read()) != -1) {
-    buffer[numRead++] = dataRead;
-    if (dataRead == '\n') {
-      buffer[numRead - 2] = '\0';
-      return WS_OK;
-    } else if (numRead > bufferLength) {
-      return WS_CLOSE_MESSAGE_TOO_BIG;
+  for (offer = strtok_r(offered, ",", &offerState); offer; offer = strtok_r(NULL, ",", &offerState)) {
+    parameter = strtok_r(offer, "; \t", &parameterState);
+    if (!parameter || strcasecmp(parameter, "permessage-deflate") != 0) {
+      continue;
+    }
+    bits = WS_DEFLATE_WINDOW_BITS;
+    while (bits && (parameter = strtok_r(NULL, "; \t", &parameterState))) {
+      if ((value = strchr(parameter, '='))) {
+        *value++ = '\0';
+        value += *value == '"';
+      }
+      if (strcasecmp(parameter, "server_max_window_bits") == 0) {
+        if (!value || atoi(value) < 8 || atoi(value) > 15) {
+          bits = 0;
+        } else if (atoi(value) < bits) {
+          bits = atoi(value);
+        }
+      } else if (strcasecmp(parameter, "server_no_context_takeover") != 0
+                 && strcasecmp(parameter, "client_no_context_takeover") != 0
+                 && strcasecmp(parameter, "client_max_window_bits") != 0) {
+        bits = 0;
+      }
+    }
+    if (bits) {
+      return bits;
     }
   }
 
-  return WS_ERROR;
+  return 0;
 }
+#endif
 
-int WebSocket::readFrame(char * payloadData, int * payloadLength, int clientId) {
-  uint8_t data;
-  int opcode;
-  int mask;
-  char maskingKey[4];
+// A route matches when its path is a prefix of the URI ending at a segment boundary.
+int WebSocket::matchRoute(char *requestURI) {
+  int matched = WS_NO_ROUTE;
+  char next;
 
-  data = client[clientId].read();
-  if (!(data & 0x80)) {
-    return WS_NOT_SUPPORTED;
+  for (int i = 0; i < numRoutes; i++) {
+    if (strncmp(requestURI, routes[i].path, routes[i].pathLength) != 0) {
+      continue;
+    }
+    next = requestURI[routes[i].pathLength];
+    if (next != '\0' && next != '/' && next != '?' && routes[i].pathLength && routes[i].path[routes[i].pathLength - 1] != '/') {
+      continue;
+    }
+    if (matched == WS_NO_ROUTE || routes[i].pathLength > routes[matched].pathLength) {
+      matched = i;
+    }
   }
-  opcode = data & 0x0f;
-
-  data = client[clientId].read();
-  mask = data & 0x80 ? true : false;
-  *payloadLength = data & 0x7f;
 
-  if (*payloadLength > 125) {
-    return WS_NOT_SUPPORTED;
-  }
+  return matched;
+}
 
-  if (mask) {
-    for (int i = 0; i < 4; i++) {
-      maskingKey[i] = client[clientId].read();
-    }
-  }
+int WebSocket::matchProtocol(char *offered) {
+  char *token;
+  int matched = WS_NO_PROTOCOL;
 
-  for (int i = 0; i < *payloadLength; i++) {
-    if (mask) {
-      payloadData[i] = client[clientId].read() ^ maskingKey[i % 4];
-    } else {
-      payloadData[i] = client[clientId].read();
+  for (token = strtok(offered, ", \t"); token; token = strtok(NULL, ", \t")) {
+    for (int i = 0; i < numProtocols; i++) {
+      if (strlen(token) == protocolLength[i] && strncmp(token, protocolLine[i] + WS_PROTOCOL_HEADER_LENGTH, protocolLength[i]) == 0) {
+        if (matched == WS_NO_PROTOCOL || i < matched) {
+          matched = i;
+        }
+        break;
+      }
     }
   }
-  payloadData[*payloadLength] = '\0';
 
-  return opcode;
+  return matched;
 }
-
@@ -3,10 +3,24 @@
 
 #include <Ethernet.h>
 #include <Arduino.h>
+#include "WebSocketConfig.h"
+#include "deflate.h"
+#include "WebSocketCapture.h"
+#include "WebSocketTimer.h"
+#include "WebSocketQueue.h"
 
 #define WS_MAX_PAYLOAD_LENGTH  125
 #define WS_MAX_LINE_LENGTH     128
 #define WS_KEY_LENGTH           32
+#define WS_ACCEPT_LENGTH        28
+#define WS_MAX_PROTOCOLS         4
+#define WS_MAX_TOPICS            8
+#define WS_MAX_ROUTES            4
+#define WS_HEADER_LENGTH         2     // header of a frame of up to WS_MAX_PAYLOAD_LENGTH bytes
+#define WS_MAX_HEADER_LENGTH    10     // header with a 64-bit extended length
+#define WS_MASK_LENGTH           4
+#define WS_LATEST_SLOTS          4     // keys for sendLatest(); a queued frame per key is replaced, not appended
+#define WS_CONTROL_BUFFER_SIZE  (WS_HEADER_LENGTH + WS_MAX_PAYLOAD_LENGTH)  // priority lane for close/ping/pong, ahead of queued data; holds the largest control frame
 
 #define WS_OK 1
 #define WS_CONNECTED 2
@@ -18,9 +32,15 @@
 #define WS_LINE_TOO_LONG  -1
 #define WS_STATUS_MISMATCH -2
 #define WS_NOT_SUPPORTED -3
+#define WS_INVALID_TOPIC -4
+#define WS_NOT_FOUND -5
+#define WS_RATE_LIMITED -6
+#define WS_QUEUE_FULL -7
 #define WS_ERROR -127
 
 #define WS_SENDTO_ALL -1
+#define WS_NO_PROTOCOL -1
+#define WS_NO_ROUTE -1
 
 #define WS_HAS_GET                    0x01
 #define WS_HAS_HOST                   0x02     
@@ -30,11 +50,20 @@
 #define WS_HAS_SEC_WEBSOCKET_VERSION  0x20
 #define WS_HAS_ALL_HEADERS            0x3f
 #define WS_HAS_SUBPROTOCOL            0x40
+#define WS_HAS_DEFLATE                0x80
 
+#define WS_FRAME_CONTINUATION 0x00
 #define WS_FRAME_TEXT   0x01
 #define WS_FRAME_BINARY 0x02
 #define WS_FRAME_CLOSE  0x08
+#define WS_FRAME_PING   0x09
+#define WS_FRAME_PONG   0x0a
+#define WS_FRAME_CONTROL 0x08
 #define WS_FRAME_FIN    0x80
+#define WS_FRAME_RSV1   0x40
+#define WS_FRAME_MASK   0x80
+#define WS_LENGTH_16    126
+#define WS_LENGTH_64    127
 
 #define WS_CLOSE_NORMAL          1000
 #define WS_CLOSE_PROTOCOL_ERROR  1002
@@ -42,6 +71,15 @@
 
 #define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
+#define WS_RESPONSE_HEADER "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+#define WS_PROTOCOL_HEADER "Sec-WebSocket-Protocol: "
+#define WS_RESPONSE_HEADER_LENGTH (sizeof(WS_RESPONSE_HEADER) - 1)
+#define WS_PROTOCOL_HEADER_LENGTH (sizeof(WS_PROTOCOL_HEADER) - 1)
+#define WS_EXTENSION_HEADER "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits="
+#define WS_EXTENSION_LINE_LENGTH (sizeof(WS_EXTENSION_HEADER) - 1 + 4)
+#define WS_UNAVAILABLE_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WS_NOT_FOUND_RESPONSE "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
 typedef enum {
   CONNECTING = 0,
   OPEN = 1,
@@ -56,33 +94,253 @@ typedef struct {
   char *variable;
 } wsHeader;
 
-typedef void (*onOpen_t)(char *requestURI, int clientId);
+#define WS_STATS_URI           "/ws-stats"  // connections here get the stats as JSON instead of reaching onOpen
+#define WS_STATS_JSON_LENGTH   288
+#define WS_HISTOGRAM_BUCKETS     8          // bucket i counts durations below 64 << (2 * i) us; the last is open-ended
+
+// One bit per client slot; topic subscribers are looked up by topic index.
+#if MAX_SOCK_NUM > 8
+typedef uint16_t wsClientMask;
+#else
+typedef uint8_t wsClientMask;
+#endif
+
+// Token bucket limiting how fast queued data is written; a rate of 0 means unlimited.
+typedef struct {
+  uint32_t rate;              // bytes per second
+  uint16_t burst;             // most tokens that can build up while idle
+  int32_t tokens;             // bytes that may be written now; negative after an unshaped write
+  unsigned long refilledAt;   // millis() the tokens were last brought up to date
+} wsTokenBucket;
+
+// A frame encoded once and sent to any number of clients without copying; see WebSocket::prepare().
+typedef struct {
+  uint8_t *frame;
+  uint16_t frameLength;
+  uint8_t *compressed;        // the same message with permessage-deflate, for clients that negotiated it
+  uint16_t compressedLength;  // 0 when it did not get smaller or deflate is compiled out
+  uint8_t references;         // output buffers still holding it; its storage may be reused at 0
+} wsPreparedMessage;
+
+#if WS_OUTPUT_BUFFER_SIZE > 0
+typedef struct {
+  uint8_t data[WS_OUTPUT_BUFFER_SIZE];
+  uint16_t length;
+  unsigned long queuedAt;  // micros() when the oldest unsent frame was queued, or the transport last had no room
+  int16_t latest[WS_LATEST_SLOTS];  // offset of the unsent frame queued by sendLatest(), -1 if none
+  uint16_t frameRemaining;          // bytes of a partly written data frame; control frames wait for them
+  uint8_t control[WS_CONTROL_BUFFER_SIZE];
+  uint8_t controlLength;
+  wsPreparedMessage *prepared;      // written from its own storage ahead of data, which is queued behind it
+  const uint8_t *preparedFrame;     // the variant of prepared this client gets
+  uint16_t preparedLength;
+  uint16_t preparedSent;
+} wsOutputBuffer;
+#endif
+
+typedef struct {
+  uint16_t arenaUsed;         // bytes taken by protocol strings and the response template
+  uint16_t arenaSize;         // WS_ARENA_SIZE, or 0 when they come from the heap
+  uint8_t blocks;             // per-connection output buffers in the pool
+  uint8_t blocksInUse;
+  uint8_t blocksHighWater;    // most ever in use at once; WS_CONNECTION_BLOCKS can be cut down to it
+} wsMemoryUsage;
+
+/*
+ * The settings in WebSocketConfig.h change the layout of class WebSocket.
+ * They are made part of the constructors' signatures, so a sketch compiled
+ * with other settings than WebSocket.cpp fails to link instead of
+ * corrupting memory.
+ */
+template <int outputBufferSize, int connectionBlocks, int features, int arenaSize, int queueLength, int queuePayloadLength, int timerSlots>
+struct wsConfigCheck {};
+typedef wsConfigCheck<WS_OUTPUT_BUFFER_SIZE, WS_CONNECTION_BLOCKS,
+                      (WS_USE_DEFLATE != 0) | (WS_USE_ARENA != 0) << 1 | (WS_USE_SUBMIT_QUEUE != 0) << 2 | (WS_USE_CAPTURE != 0) << 3 | (WS_USE_STATS != 0) << 4,
+                      WS_ARENA_SIZE, WS_SUBMIT_QUEUE_LENGTH, WS_SUBMIT_PAYLOAD_LENGTH, WS_TIMER_SLOTS> wsConfig;
+
+#if WS_USE_STATS
+#define WS_STAT(statement) statement
+#else
+#define WS_STAT(statement)
+#endif
+
+#if WS_USE_CAPTURE
+#define WS_CAPTURE(statement) statement
+#else
+#define WS_CAPTURE(statement)
+#endif
+
+typedef struct {
+  uint32_t framesIn;
+  uint32_t framesOut;
+  uint32_t bytesIn;
+  uint32_t bytesOut;
+  uint16_t protocolErrors;
+  uint16_t queueDepth;     // bytes waiting in the output buffer
+  uint16_t rateLimited;    // frames refused with WS_RATE_LIMITED
+  int32_t tokens;          // bytes the rate limit lets through now
+} wsClientStats;
+
+// Why a handshake was refused.
+typedef enum {
+  WS_FAILED_OTHER = 0,
+  WS_FAILED_LINE_TOO_LONG,
+  WS_FAILED_STATUS_MISMATCH,
+  WS_FAILED_NOT_SUPPORTED,
+  WS_FAILED_NOT_FOUND,
+  WS_HANDSHAKE_FAILURES
+} wsHandshakeFailure;
+
+typedef struct {
+  wsClientStats client[MAX_SOCK_NUM];
+  uint16_t handshakeFailures[WS_HANDSHAKE_FAILURES];  // indexed by wsHandshakeFailure
+  uint16_t handshakeTime[WS_HISTOGRAM_BUCKETS];       // microseconds to parse and answer the upgrade
+  uint16_t dispatchTime[WS_HISTOGRAM_BUCKETS];        // microseconds from frame arrival to onMessage return
+  int32_t globalTokens;                               // bytes the global rate limit lets through now
+} wsStats;
+
+typedef void (*onOpen_t)(char *requestURI, int protocol, int clientId);
 typedef void (*onMessage_t)(char *payload, int payloadLength, int clientId);
 typedef void (*onClose_t)(int clientId);
 typedef void (*onError_t)(int clientId);
+typedef int (*streamRead_t)(uint8_t *buffer, int bufferLength, void *context);  // returns 0 at the end
+
+// A route served by an object rather than by plain callbacks, so that each route can have state of its own.
+class WebSocketRoute {
+public:
+  virtual void onOpen(char *requestURI, int protocol, int clientId) = 0;
+  virtual void onMessage(char *payload, int payloadLength, int clientId) = 0;
+  virtual void onClose(int clientId) = 0;
+};
+
+// Handlers for connections whose request URI starts with path; NULL handlers are skipped.
+typedef struct {
+  const char *path;
+  uint8_t pathLength;
+  onOpen_t onOpen;
+  onMessage_t onMessage;
+  onClose_t onClose;
+  WebSocketRoute *handler;    // used instead of the callbacks when set
+} wsRoute;
 
 class WebSocket {
 public:
-  WebSocket(uint16_t port, char *supportedProtocol, onOpen_t onOpen = NULL, onMessage_t onMessage = NULL, onClose_t onClose = NULL, onError_t onError = NULL);
+  WebSocket(uint16_t port, char *supportedProtocol, onOpen_t onOpen = NULL, onMessage_t onMessage = NULL, onClose_t onClose = NULL, onError_t onError = NULL, wsConfig = wsConfig());
+  WebSocket(uint16_t port, char **supportedProtocols, uint8_t numProtocols, onOpen_t onOpen = NULL, onMessage_t onMessage = NULL, onClose_t onClose = NULL, onError_t onError = NULL, wsConfig = wsConfig());
   wsStatus status[MAX_SOCK_NUM];
   void begin();
   int available(int *clientId);
+  int waitForEvent(unsigned long timeout);
   int sendText(char *text, int clientId);
   int sendBinary(uint8_t *data, uint8_t dataLength, int clientId);
   int sendPayload(uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode, int clientId);
   int sendClose(uint16_t statusCode, int clientId);
+  int sendPing(uint8_t *payLoadData, uint8_t payloadLength, int clientId);
+  int sendStream(Stream &source, uint32_t length, uint8_t opcode, int clientId);
+  int sendStream(streamRead_t read, void *context, uint8_t opcode, int clientId);
+  int sendBuffer(const uint8_t *data, uint32_t length, uint8_t opcode, int clientId);
+  void setStreamChunkSize(uint16_t chunkSize);
+  int prepare(wsPreparedMessage *message, uint8_t *storage, uint16_t storageLength, const uint8_t *payload, uint16_t payloadLength, uint8_t opcode = WS_FRAME_TEXT);
+  int sendPrepared(wsPreparedMessage *message, int clientId);
+  int sendLatest(uint8_t slot, uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode, int clientId);
+  int subscribe(uint8_t topic, int clientId);
+  int unsubscribe(uint8_t topic, int clientId);
+  int publish(uint8_t topic, uint8_t *data, uint8_t dataLength, uint8_t opcode = WS_FRAME_TEXT);
+  void setBatching(unsigned long flushDeadline);
+  void setRateLimit(uint32_t bytesPerSecond, uint16_t burst, int clientId);
+  void setGlobalRateLimit(uint32_t bytesPerSecond, uint16_t burst);
+  int flush(int clientId);
+  void setCompression(bool enabled, int clientId);
+  int addRoute(const char *path, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose = NULL);
+  int addRoute(const char *path, WebSocketRoute *handler);
+#if WS_USE_STATS
+  wsStats *getStats();
+  void resetStats();
+#endif
+  wsMemoryUsage getMemoryUsage();
+  int parseRequest(Client &client, char *requestURI, char *wsKey, int *protocol, int *deflateBits);
+#if WS_USE_SUBMIT_QUEUE
+  int post(int clientId, const uint8_t *data, uint8_t dataLength, uint8_t opcode = WS_FRAME_TEXT);
+#endif
+  void schedule(wsTimer *timer, unsigned long delay, onTimer_t callback, int clientId);
+  void cancel(wsTimer *timer);
+#if WS_USE_CAPTURE
+  void setCapture(Print *sink);
+  int replay(Stream &capture, bool realTime = false);
+#endif
 private:
   EthernetServer server;
   EthernetClient client[MAX_SOCK_NUM];
   uint16_t port;
-  char *supportedProtocol;
+  char *protocolLine[WS_MAX_PROTOCOLS]; // "Sec-WebSocket-Protocol: <name>\r\n\r\n"
+  uint8_t protocolLength[WS_MAX_PROTOCOLS];
+  uint8_t numProtocols;
+  char *response;                       // pre-rendered 101 response, Accept key patched per handshake
+#if WS_USE_ARENA
+  char arena[WS_ARENA_SIZE];
+#endif
+  uint16_t arenaUsed;
+  wsClientMask subscribers[WS_MAX_TOPICS];
+  wsRoute routes[WS_MAX_ROUTES];
+  uint8_t numRoutes;
+  int8_t route[MAX_SOCK_NUM];           // index into routes resolved at handshake, WS_NO_ROUTE for the default handlers
+#if WS_OUTPUT_BUFFER_SIZE > 0
+  wsOutputBuffer *output[MAX_SOCK_NUM]; // taken from blocks while a connection is open, NULL otherwise
+  wsOutputBuffer blocks[WS_CONNECTION_BLOCKS];
+  uint8_t freeBlocks[WS_CONNECTION_BLOCKS]; // stack of indices into blocks
+  uint8_t numFree;
+  uint8_t blocksHighWater;
+  wsTokenBucket shaper[MAX_SOCK_NUM];   // kept per slot, so a limit set before a client connects applies to it
+  unsigned long flushDeadline;          // microseconds a frame may wait in output; 0 writes through
+  wsTokenBucket globalShaper;           // shared by all connections, on top of their own
+#endif
+#if WS_USE_DEFLATE
+  DeflateArena deflateArena;            // shared by all connections, only used inside a single call
+  uint8_t windowBits[MAX_SOCK_NUM];     // negotiated server_max_window_bits, 0 without permessage-deflate
+  wsClientMask compressionDisabled;     // connections that opted out of compressing outgoing messages
+  int matchDeflate(char *offered);
+#endif
+#if WS_USE_STATS
+  wsStats stats;
+  wsClientMask statsClients;            // connections opened on WS_STATS_URI
+  void sendStats(int clientId);
+#endif
+#if WS_USE_CAPTURE
+  WebSocketCapture capture;
+  wsCaptureClient transport[MAX_SOCK_NUM];  // what io() hands out: client[] or, during replay(), the captured bytes
+  void replayed(wsReplayClient *source, int clientId, bool more);
+#endif
+  uint16_t streamChunkSize;
+  wsTimerWheel timers;
+#if WS_USE_SUBMIT_QUEUE
+  wsSubmitQueue submitted;
+  void sendSubmitted();
+#endif
   onOpen_t onOpen;
   onMessage_t onMessage;
   onClose_t onClose;
   onError_t onError;
-  int handshake(char *requestURI, int clientId);
-  int readHTMLHeader(uint8_t *buffer, uint8_t bufferLength, int clientId); 
-  int readFrame(char *frame, int *payloadLength, int clientId);
+  char *allocate(int size);
+  int acquire(int clientId);
+  void init(char **supportedProtocols, uint8_t numProtocols, onOpen_t onOpen, onMessage_t onMessage, onClose_t onClose, onError_t onError);
+  Client &io(int clientId);
+  int receive(int clientId);
+  int accept(int clientId);
+  int handshake(char *requestURI, int *protocol, int clientId);
+  int matchProtocol(char *offered);
+  int matchRoute(char *requestURI);
+  void release(int clientId);
+  int encodePayload(uint8_t *frame, uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode, int clientId);
+  int writeFrame(uint8_t *frame, int frameLength, int clientId);
+  int replaceFrame(uint8_t slot, uint8_t *frame, int frameLength, int clientId);
+  void drain(int clientId);
+  int writePrepared(int limit, int clientId);
+  void consumed(int length, int clientId);
+  int32_t allowance(int clientId);
+  void spend(int length, int clientId);
+  void flushExpired();
+  unsigned long nextDeadline(unsigned long timeout);
+  void idle();
 };
 
 #endif /* WEBSOCKET_H */
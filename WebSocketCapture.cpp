@@ -0,0 +1,115 @@
+#include "WebSocketCapture.h"
+
+WebSocketCapture::WebSocketCapture() {
+  sink = NULL;
+  pendingLength = 0;
+}
+
+void WebSocketCapture::record(unsigned long at, uint8_t client, const uint8_t *data, uint16_t length) {
+  uint8_t header[WS_CAPTURE_HEADER_LENGTH];
+
+  for (int i = 0; i < 4; i++) {
+    header[i] = (uint8_t)(at >> (8 * i));
+  }
+  header[4] = client;
+  header[5] = (uint8_t)length;
+  header[6] = (uint8_t)(length >> 8);
+  sink->write(header, WS_CAPTURE_HEADER_LENGTH);
+  sink->write(data, length);
+}
+
+void WebSocketCapture::received(uint8_t clientId, const uint8_t *data, int length) {
+  int chunk;
+
+  if (!sink) {
+    return;
+  }
+  if (pendingLength && pendingClient != clientId) {
+    flush();
+  }
+  while (length > 0) {
+    if (pendingLength == 0) {
+      pendingClient = clientId;
+      pendingAt = micros();
+    }
+    chunk = WS_CAPTURE_CHUNK_SIZE - pendingLength;
+    if (chunk > length) {
+      chunk = length;
+    }
+    memcpy(pending + pendingLength, data, chunk);
+    pendingLength += chunk;
+    data += chunk;
+    length -= chunk;
+    if (pendingLength == WS_CAPTURE_CHUNK_SIZE) {
+      flush();
+    }
+  }
+}
+
+void WebSocketCapture::sent(uint8_t clientId, const uint8_t *data, int length) {
+  unsigned long at = micros();
+
+  if (!sink || length <= 0) {
+    return;
+  }
+  // Whatever was read so far happened first.
+  flush();
+  // The length field is 16 bits; a larger write, such as sendBuffer() makes, takes several records.
+  while ((uint32_t)length > WS_CAPTURE_RECORD_LENGTH) {
+    record(at, clientId | WS_CAPTURE_SENT, data, WS_CAPTURE_RECORD_LENGTH);
+    data += WS_CAPTURE_RECORD_LENGTH;
+    length -= WS_CAPTURE_RECORD_LENGTH;
+  }
+  record(at, clientId | WS_CAPTURE_SENT, data, length);
+}
+
+void WebSocketCapture::flush() {
+  if (sink && pendingLength) {
+    record(pendingAt, pendingClient, pending, pendingLength);
+  }
+  pendingLength = 0;
+}
+
+size_t wsCaptureClient::write(const uint8_t *buf, size_t size) {
+  size_t written = target->write(buf, size);
+
+  capture->sent(clientId, buf, written);
+  return written;
+}
+
+int wsCaptureClient::read() {
+  int data = target->read();
+  uint8_t byte = (uint8_t)data;
+
+  if (data >= 0) {
+    capture->received(clientId, &byte, 1);
+  }
+  return data;
+}
+
+int wsCaptureClient::read(uint8_t *buf, size_t size) {
+  int numRead = target->read(buf, size);
+
+  if (numRead > 0) {
+    capture->received(clientId, buf, numRead);
+  }
+  return numRead;
+}
+
+wsReplayClient::wsReplayClient() {
+  length = 0;
+  position = 0;
+  bytesWritten = 0;
+}
+
+int wsReplayClient::read(uint8_t *buf, size_t size) {
+  if (position >= length) {
+    return -1;
+  }
+  if (size > (size_t)(length - position)) {
+    size = length - position;
+  }
+  memcpy(buf, data + position, size);
+  position += size;
+  return size;
+}
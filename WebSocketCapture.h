@@ -0,0 +1,82 @@
+#ifndef WEBSOCKETCAPTURE_H
+#define WEBSOCKETCAPTURE_H
+
+#include <Ethernet.h>
+#include <Arduino.h>
+
+/*
+ * Capture format: a sequence of records, each a 7 byte header followed by
+ * the bytes themselves. The header holds micros() as a little-endian
+ * uint32, the client slot (with WS_CAPTURE_SENT set for outgoing bytes),
+ * and the byte count as a little-endian uint16.
+ */
+#define WS_CAPTURE_HEADER_LENGTH    7
+#define WS_CAPTURE_SENT          0x80
+#define WS_CAPTURE_RECORD_LENGTH 0xffff   // most bytes one record can hold
+#define WS_CAPTURE_CHUNK_SIZE      32     // received bytes are read one at a time; they are coalesced up to this
+#ifndef WS_REPLAY_BUFFER_SIZE
+#define WS_REPLAY_BUFFER_SIZE     512     // largest run of received bytes replay() hands to one client at once
+#endif
+
+class WebSocketCapture {
+public:
+  WebSocketCapture();
+  Print *sink;
+  void received(uint8_t clientId, const uint8_t *data, int length);
+  void sent(uint8_t clientId, const uint8_t *data, int length);
+  void flush();
+private:
+  uint8_t pending[WS_CAPTURE_CHUNK_SIZE];
+  uint8_t pendingLength;
+  uint8_t pendingClient;
+  unsigned long pendingAt;
+  void record(unsigned long at, uint8_t client, const uint8_t *data, uint16_t length);
+};
+
+// Forwards to target and records whatever passes through.
+class wsCaptureClient : public Client {
+public:
+  Client *target;
+  WebSocketCapture *capture;
+  uint8_t clientId;
+  int connect(IPAddress ip, uint16_t port) { return target->connect(ip, port); }
+  int connect(const char *host, uint16_t port) { return target->connect(host, port); }
+  size_t write(uint8_t data) { return write(&data, 1); }
+  size_t write(const uint8_t *buf, size_t size);
+  int availableForWrite() { return target->availableForWrite(); }
+  int available() { return target->available(); }
+  int read();
+  int read(uint8_t *buf, size_t size);
+  int peek() { return target->peek(); }
+  void flush() { target->flush(); }
+  void stop() { target->stop(); }
+  uint8_t connected() { return target->connected(); }
+  operator bool() { return (bool)*target; }
+  using Print::write;
+};
+
+// Stands in for every connection during WebSocket::replay(): serves captured bytes, discards writes.
+class wsReplayClient : public Client {
+public:
+  wsReplayClient();
+  uint8_t data[WS_REPLAY_BUFFER_SIZE];
+  uint16_t length;
+  uint16_t position;
+  uint32_t bytesWritten;
+  int connect(IPAddress, uint16_t) { return 0; }
+  int connect(const char *, uint16_t) { return 0; }
+  size_t write(uint8_t) { bytesWritten++; return 1; }
+  size_t write(const uint8_t *, size_t size) { bytesWritten += size; return size; }
+  int availableForWrite() { return WS_REPLAY_BUFFER_SIZE; }
+  int available() { return length - position; }
+  int read() { return position < length ? data[position++] : -1; }
+  int read(uint8_t *buf, size_t size);
+  int peek() { return position < length ? data[position] : -1; }
+  void flush() {}
+  void stop() {}
+  uint8_t connected() { return position < length; }  // a read past the end fails at once instead of waiting out a timeout
+  operator bool() { return true; }
+  using Print::write;
+};
+
+#endif /* WEBSOCKETCAPTURE_H */
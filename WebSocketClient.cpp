@@ -0,0 +1,169 @@
+#include "WebSocketClient.h"
+#include "WebSocketFrame.h"
+#include "sha1.h"
+#include "base64.h"
+
+WebSocketClient::WebSocketClient(onMessage_t onMessage, onClose_t onClose, int clientId) {
+  this->onMessage = onMessage;
+  this->onClose = onClose;
+  this->clientId = clientId;
+  status = CLOSED;
+  // Seeded on the first connect(): global clients are constructed before the core has started micros().
+  randomState = 0;
+}
+
+void WebSocketClient::seed(uint32_t seed) {
+  // xorshift must never hold zero.
+  randomState = seed ? seed : 0x2545f491;
+}
+
+int WebSocketClient::connect(IPAddress ip, uint16_t port, char *host, char *requestURI, char *protocol) {
+  if (!client.connect(ip, port)) {
+    return WS_NO_CLIENT;
+  }
+  return handshake(host, requestURI, protocol);
+}
+
+int WebSocketClient::connect(char *host, uint16_t port, char *requestURI, char *protocol) {
+  if (!client.connect(host, port)) {
+    return WS_NO_CLIENT;
+  }
+  return handshake(host, requestURI, protocol);
+}
+
+int WebSocketClient::available() {
+  char payloadData[WS_MAX_PAYLOAD_LENGTH + 1];
+  int payloadLength;
+  int opcode;
+
+  if (status != OPEN || !client.available()) {
+    return WS_NO_DATA;
+  }
+
+  opcode = wsReadFrame(client, payloadData, &payloadLength);
+  switch (opcode) {
+    case WS_FRAME_TEXT:
+    case WS_FRAME_BINARY:
+      if (onMessage) {
+        onMessage(payloadData, payloadLength, clientId);
+      }
+      return WS_DATA_RECEIVCED;
+    case WS_FRAME_CLOSE:
+      if (onClose) {
+        onClose(clientId);
+      }
+      sendClose(WS_CLOSE_NORMAL);
+      client.stop();
+      return WS_CLOSED;
+    case WS_FRAME_PING:
+      sendPayload((uint8_t *)payloadData, payloadLength, WS_FRAME_PONG);
+      return WS_NO_DATA;
+    case WS_FRAME_PONG:
+      return WS_NO_DATA;
+    default:
+      return WS_PROTOCOL_ERROR;
+  }
+}
+
+int WebSocketClient::sendText(char *text) {
+  return sendPayload((uint8_t *)text, strlen(text), WS_FRAME_TEXT);
+}
+
+int WebSocketClient::sendBinary(uint8_t *data, uint8_t dataLength) {
+  return sendPayload(data, dataLength, WS_FRAME_BINARY);
+}
+
+int WebSocketClient::sendPayload(uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode) {
+  uint8_t frame[WS_HEADER_LENGTH + WS_MASK_LENGTH + WS_MAX_PAYLOAD_LENGTH];
+  uint32_t maskingKey;
+  int frameLength;
+
+  if (status != OPEN) {
+    return WS_STATUS_MISMATCH;
+  }
+
+  maskingKey = wsRandom(&randomState);
+  if ((frameLength = wsEncodeFrame(frame, payLoadData, payloadLength, opcode, (uint8_t *)&maskingKey)) < 0) {
+    return frameLength;
+  }
+  client.write(frame, frameLength);
+  return WS_OK;
+}
+
+int WebSocketClient::sendClose(uint16_t statusCode) {
+  uint8_t code[2];
+  int retval;
+
+  code[0] = (uint8_t)(statusCode >> 8);
+  code[1] = (uint8_t)(statusCode & 0xff);
+  retval = sendPayload(code, 2, WS_FRAME_CLOSE);
+  status = CLOSED;
+  return retval;
+}
+
+int WebSocketClient::handshake(char *host, char *requestURI, char *protocol) {
+  char buffer[WS_MAX_LINE_LENGTH];
+  char wsKey[WS_MAX_LINE_LENGTH];
+  char accept[WS_ACCEPT_LENGTH + 1];
+  uint8_t nonce[WS_CLIENT_KEY_LENGTH];
+  uint32_t word;
+  uint8_t headerValidation = 0;
+  SHA1Context sha;
+
+  // The time the TCP connect took varies from boot to boot and from device to device.
+  if (!randomState) {
+    seed(micros() ^ ((uint32_t)clientId << 16));
+  }
+  for (int i = 0; i < WS_CLIENT_KEY_LENGTH; i += 4) {
+    word = wsRandom(&randomState);
+    memcpy(nonce + i, &word, 4);
+  }
+  base64Encode(nonce, WS_CLIENT_KEY_LENGTH, wsKey);
+
+  client.print("GET ");
+  client.print(requestURI);
+  client.print(" HTTP/1.1\r\nHost: ");
+  client.print(host);
+  client.print("\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: ");
+  client.print(wsKey);
+  client.print("\r\nSec-WebSocket-Version: 13\r\n");
+  if (protocol) {
+    client.print(WS_PROTOCOL_HEADER);
+    client.print(protocol);
+    client.print("\r\n");
+  }
+  client.print("\r\n");
+
+  strcat(wsKey, WS_GUID);
+  SHA1Reset(&sha);
+  SHA1Input(&sha, (uint8_t *)wsKey, strlen(wsKey));
+  SHA1Result(&sha, (uint8_t *)buffer);
+  base64Encode((uint8_t *)buffer, SHA1HashSize, accept);
+
+  // Response headers end with an empty line; the server may already send frames after it.
+  while (wsReadLine(client, buffer, WS_MAX_LINE_LENGTH, WS_HANDSHAKE_TIMEOUT) > 0 && buffer[0]) {
+    if (strncmp(buffer, "HTTP/1.1 101", 12) == 0) {
+      headerValidation |= WS_HAS_GET;
+    } else if (strncasecmp(buffer, "upgrade:", 8) == 0) {
+      strtok(buffer, " \t");
+      if (strncasecmp(strtok(NULL, " \t"), "websocket", 9) == 0) {
+        headerValidation |= WS_HAS_UPGRADE;
+      }
+    } else if (strncasecmp(buffer, "connection:", 11) == 0) {
+      headerValidation |= WS_HAS_CONNECTION;
+    } else if (strncasecmp(buffer, "sec-websocket-accept:", 21) == 0) {
+      strtok(buffer, " \t");
+      if (strcmp(strtok(NULL, " \t"), accept) == 0) {
+        headerValidation |= WS_HAS_SEC_WEBSOCKET_KEY;
+      }
+    }
+  }
+
+  if ((headerValidation & (WS_HAS_GET | WS_HAS_UPGRADE | WS_HAS_CONNECTION | WS_HAS_SEC_WEBSOCKET_KEY)) == (WS_HAS_GET | WS_HAS_UPGRADE | WS_HAS_CONNECTION | WS_HAS_SEC_WEBSOCKET_KEY)) {
+    status = OPEN;
+    return WS_CONNECTED;
+  } else {
+    client.stop();
+    return WS_ERROR;
+  }
+}
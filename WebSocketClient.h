@@ -0,0 +1,32 @@
+#ifndef WEBSOCKETCLIENT_H
+#define WEBSOCKETCLIENT_H
+
+#include <Ethernet.h>
+#include <Arduino.h>
+#include "WebSocket.h"
+
+#define WS_CLIENT_KEY_LENGTH         16
+#define WS_HANDSHAKE_TIMEOUT       5000
+
+class WebSocketClient {
+public:
+  WebSocketClient(onMessage_t onMessage = NULL, onClose_t onClose = NULL, int clientId = 0);
+  wsStatus status;
+  void seed(uint32_t seed);
+  int connect(IPAddress ip, uint16_t port, char *host, char *requestURI, char *protocol = NULL);
+  int connect(char *host, uint16_t port, char *requestURI, char *protocol = NULL);
+  int available();
+  int sendText(char *text);
+  int sendBinary(uint8_t *data, uint8_t dataLength);
+  int sendPayload(uint8_t *payLoadData, uint8_t payloadLength, uint8_t opcode);
+  int sendClose(uint16_t statusCode);
+private:
+  EthernetClient client;
+  onMessage_t onMessage;
+  onClose_t onClose;
+  int clientId;          // passed back to the callbacks so several clients can share them
+  uint32_t randomState;  // 0 until seeded
+  int handshake(char *host, char *requestURI, char *protocol);
+};
+
+#endif /* WEBSOCKETCLIENT_H */
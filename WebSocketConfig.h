@@ -0,0 +1,57 @@
+#ifndef WEBSOCKETCONFIG_H
+#define WEBSOCKETCONFIG_H
+
+/*
+ * Build settings of the library. Change them here, or with -D flags that
+ * apply to the whole build; a #define in the sketch does not reach
+ * WebSocket.cpp.
+ */
+
+// Per-client buffer used to coalesce small outgoing frames into one write; 0 compiles batching out.
+#ifndef WS_OUTPUT_BUFFER_SIZE
+#define WS_OUTPUT_BUFFER_SIZE    0
+#endif
+#ifndef WS_CONNECTION_BLOCKS
+#define WS_CONNECTION_BLOCKS    MAX_SOCK_NUM  // output buffers shared by the slots; a connection without one gets a 503
+#endif
+#ifndef WS_STREAM_CHUNK_SIZE
+#define WS_STREAM_CHUNK_SIZE    64     // largest chunk sendStream() reads from its source; sized against the stack
+#endif
+
+// permessage-deflate with no context takeover, over a fixed arena; 0 compiles it out.
+#ifndef WS_USE_DEFLATE
+#define WS_USE_DEFLATE           0
+#endif
+#ifndef WS_DEFLATE_WINDOW_BITS
+#define WS_DEFLATE_WINDOW_BITS   9     // largest server_max_window_bits we advertise (8..15)
+#endif
+
+// Protocol strings and the response template in a fixed arena instead of on the heap; 0 uses malloc().
+#ifndef WS_USE_ARENA
+#define WS_USE_ARENA             0
+#endif
+// The response template takes about 160 bytes plus the longest protocol, and 130 more with deflate.
+#ifndef WS_ARENA_SIZE
+#if WS_USE_DEFLATE
+#define WS_ARENA_SIZE          384
+#else
+#define WS_ARENA_SIZE          256
+#endif
+#endif
+
+// post() for handing messages to the loop from other threads or interrupts; 0 compiles it out.
+#ifndef WS_USE_SUBMIT_QUEUE
+#define WS_USE_SUBMIT_QUEUE      0
+#endif
+
+// Recording of every byte read and written, for replay(); 0 compiles it out.
+#ifndef WS_USE_CAPTURE
+#define WS_USE_CAPTURE           0
+#endif
+
+// Per-client counters and latency histograms; 0 compiles them out.
+#ifndef WS_USE_STATS
+#define WS_USE_STATS             0
+#endif
+
+#endif /* WEBSOCKETCONFIG_H */
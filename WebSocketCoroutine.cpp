@@ -0,0 +1,69 @@
+#include "WebSocketCoroutine.h"
+
+#if WS_USE_COROUTINES
+WebSocketConnection::ReceiveAwaiter WebSocketConnection::receive() {
+  return ReceiveAwaiter{this};
+}
+
+WebSocketConnection::ResultAwaiter WebSocketConnection::send(uint8_t *data, uint8_t dataLength, uint8_t opcode) {
+  return ResultAwaiter{ws->sendPayload(data, dataLength, opcode, clientId)};
+}
+
+WebSocketConnection::ResultAwaiter WebSocketConnection::sendText(char *text) {
+  return ResultAwaiter{ws->sendText(text, clientId)};
+}
+
+WebSocketConnection::ResultAwaiter WebSocketConnection::close(uint16_t statusCode) {
+  int result = ws->sendClose(statusCode, clientId);
+
+  // WebSocket does not report closes it initiates, so later receives must not wait for one.
+  closed = true;
+  message.payload = NULL;
+  message.payloadLength = -1;
+  return ResultAwaiter{result};
+}
+
+void WebSocketConnection::deliver(char *payload, int payloadLength) {
+  std::coroutine_handle<> handle = waiting;
+
+  message.payload = payload;
+  message.payloadLength = payloadLength;
+  if (handle) {
+    waiting = nullptr;
+    handle.resume();
+  }
+}
+
+WebSocketCoroutines::WebSocketCoroutines(WebSocket &ws, const char *path, wsConnectionHandler_t handler) {
+  this->ws = &ws;
+  this->handler = handler;
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    connection[i].clientId = i;
+    connection[i].ws = &ws;
+    connection[i].waiting = nullptr;
+    connection[i].closed = true;
+  }
+  ws.addRoute(path, this);
+}
+
+void WebSocketCoroutines::onOpen(char *requestURI, int protocol, int clientId) {
+  WebSocketConnection *c = &connection[clientId];
+
+  // A handler still waiting from an earlier connection on this slot was closed by us; drop its frame.
+  if (c->waiting) {
+    c->waiting.destroy();
+    c->waiting = nullptr;
+  }
+  c->closed = false;
+  handler(*c, requestURI, protocol);
+}
+
+void WebSocketCoroutines::onMessage(char *payload, int payloadLength, int clientId) {
+  connection[clientId].deliver(payload, payloadLength);
+}
+
+void WebSocketCoroutines::onClose(int clientId) {
+  connection[clientId].closed = true;
+  connection[clientId].deliver(NULL, -1);
+}
+#endif
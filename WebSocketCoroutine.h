@@ -0,0 +1,88 @@
+#ifndef WEBSOCKETCOROUTINE_H
+#define WEBSOCKETCOROUTINE_H
+
+#include "WebSocket.h"
+
+// Awaitable connections need C++20 coroutines; on older toolchains this header is empty.
+#ifndef WS_USE_COROUTINES
+#if defined(__has_include) && __cplusplus >= 202002L
+#if __has_include(<coroutine>)
+#define WS_USE_COROUTINES        1
+#endif
+#endif
+#endif
+#ifndef WS_USE_COROUTINES
+#define WS_USE_COROUTINES        0
+#endif
+
+#if WS_USE_COROUTINES
+#include <coroutine>
+
+// Return type of a connection handler. It starts running at once and frees its frame when it returns.
+struct wsTask {
+  struct promise_type {
+    wsTask get_return_object() { return wsTask(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+};
+
+typedef struct {
+  char *payload;          // valid until the next co_await
+  int payloadLength;      // -1 once the connection is closed
+} wsMessage;
+
+class WebSocketConnection {
+public:
+  // The awaiters are returned by value and live in the handler's frame; nothing is allocated per operation.
+  struct ReceiveAwaiter {
+    WebSocketConnection *connection;
+    bool await_ready() { return connection->closed; }
+    void await_suspend(std::coroutine_handle<> handle) { connection->waiting = handle; }
+    wsMessage await_resume() { return connection->message; }
+  };
+  struct ResultAwaiter {
+    int result;
+    bool await_ready() { return true; }
+    void await_suspend(std::coroutine_handle<>) {}
+    int await_resume() { return result; }
+  };
+
+  int clientId;
+  ReceiveAwaiter receive();
+  ResultAwaiter send(uint8_t *data, uint8_t dataLength, uint8_t opcode = WS_FRAME_TEXT);
+  ResultAwaiter sendText(char *text);
+  ResultAwaiter close(uint16_t statusCode = WS_CLOSE_NORMAL);
+private:
+  friend class WebSocketCoroutines;
+  WebSocket *ws;
+  std::coroutine_handle<> waiting;  // handler suspended in receive(), if any
+  wsMessage message;
+  bool closed;
+  void deliver(char *payload, int payloadLength);
+};
+
+typedef wsTask (*wsConnectionHandler_t)(WebSocketConnection &connection, char *requestURI, int protocol);
+
+/*
+ * Runs handler as a coroutine for every connection on path. The handler
+ * is driven from WebSocket::available(): each received message resumes
+ * the co_await receive() it is suspended in. requestURI is only valid
+ * until the handler first suspends.
+ */
+class WebSocketCoroutines : public WebSocketRoute {
+public:
+  WebSocketCoroutines(WebSocket &ws, const char *path, wsConnectionHandler_t handler);
+  void onOpen(char *requestURI, int protocol, int clientId);
+  void onMessage(char *payload, int payloadLength, int clientId);
+  void onClose(int clientId);
+private:
+  WebSocket *ws;
+  wsConnectionHandler_t handler;
+  WebSocketConnection connection[MAX_SOCK_NUM];
+};
+#endif
+
+#endif /* WEBSOCKETCOROUTINE_H */
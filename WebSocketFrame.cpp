@@ -0,0 +1,158 @@
+#include "WebSocket.h"
+#include "WebSocketFrame.h"
+
+int wsEncodeHeader(uint8_t *header, uint32_t payloadLength, uint8_t opcode, const uint8_t *maskingKey, bool fin) {
+  int headerLength = 2;
+
+  header[0] = (fin ? WS_FRAME_FIN : 0) | opcode;
+  if (payloadLength <= WS_MAX_PAYLOAD_LENGTH) {
+    header[1] = payloadLength;
+  } else if (payloadLength <= 0xffff) {
+    header[1] = WS_LENGTH_16;
+    header[2] = (uint8_t)(payloadLength >> 8);
+    header[3] = (uint8_t)payloadLength;
+    headerLength = 4;
+  } else {
+    header[1] = WS_LENGTH_64;
+    for (int i = 0; i < 8; i++) {
+      header[2 + i] = i < 4 ? 0 : (uint8_t)(payloadLength >> (8 * (7 - i)));
+    }
+    headerLength = 10;
+  }
+  if (maskingKey) {
+    header[1] |= WS_FRAME_MASK;
+    memcpy(header + headerLength, maskingKey, WS_MASK_LENGTH);
+    headerLength += WS_MASK_LENGTH;
+  }
+
+  return headerLength;
+}
+
+int wsEncodeFrame(uint8_t *frame, uint8_t *payloadData, uint8_t payloadLength, uint8_t opcode, const uint8_t *maskingKey) {
+  int headerLength;
+
+  if (payloadLength > WS_MAX_PAYLOAD_LENGTH) {
+    return WS_LINE_TOO_LONG;
+  }
+
+  headerLength = wsEncodeHeader(frame, payloadLength, opcode, maskingKey);
+  memcpy(frame + headerLength, payloadData, payloadLength);
+  if (maskingKey) {
+    wsMask(frame + headerLength, payloadLength, maskingKey);
+  }
+
+  return headerLength + payloadLength;
+}
+
+int wsReadFrame(Client &client, char *payloadData, int *payloadLength, unsigned long timeout) {
+  uint8_t data;
+  int opcode;
+  int mask;
+  uint8_t maskingKey[WS_MASK_LENGTH];
+  int numRead;
+  int dataRead;
+  unsigned long start;
+
+  data = client.read();
+  if (!(data & 0x80)) {
+    return WS_NOT_SUPPORTED;
+  }
+  opcode = data & (WS_FRAME_RSV1 | 0x0f);   // RSV1 is left for the caller to interpret
+
+  data = client.read();
+  mask = data & WS_FRAME_MASK ? true : false;
+  *payloadLength = data & 0x7f;
+
+  if (*payloadLength > 125) {
+    return WS_NOT_SUPPORTED;
+  }
+
+  if (mask) {
+    for (int i = 0; i < WS_MASK_LENGTH; i++) {
+      maskingKey[i] = client.read();
+    }
+  }
+
+  // Read the payload in bulk, then unmask it a word at a time.
+  start = millis();
+  for (numRead = 0; numRead < *payloadLength; numRead += dataRead) {
+    if ((dataRead = client.read((uint8_t *)payloadData + numRead, *payloadLength - numRead)) <= 0) {
+      if (!client.connected() || millis() - start >= timeout) {
+        return WS_ERROR;
+      }
+      dataRead = 0;
+    }
+  }
+  if (mask) {
+    wsMask((uint8_t *)payloadData, *payloadLength, maskingKey);
+  }
+  payloadData[*payloadLength] = '\0';
+
+  return opcode;
+}
+
+int wsReadLine(Client &client, char *buffer, uint8_t bufferLength, unsigned long timeout) {
+  int dataRead;
+  int numRead = 0;
+  unsigned long start = millis();
+
+  for (;;) {
+    if ((dataRead = client.read()) == -1) {
+      if (millis() - start < timeout) {
+        continue;
+      }
+      return WS_ERROR;
+    }
+    if (dataRead == '\n') {
+      if (numRead > 0 && buffer[numRead - 1] == '\r') {
+        numRead--;
+      }
+      buffer[numRead] = '\0';
+      return WS_OK;
+    } else if (numRead >= bufferLength - 1) {
+      return WS_LINE_TOO_LONG;
+    }
+    buffer[numRead++] = dataRead;
+  }
+}
+
+void wsMask(uint8_t *data, int length, const uint8_t *maskingKey) {
+  uint8_t rotated[WS_MASK_LENGTH];
+  uint32_t key;
+  uint32_t word;
+  int i = 0;
+
+  // Bytes up to the first word boundary.
+  for (; i < length && ((uintptr_t)(data + i) & 3); i++) {
+    data[i] ^= maskingKey[i & 3];
+  }
+
+  // The key rotated to line up with the aligned words, applied four bytes at a time.
+  for (int j = 0; j < WS_MASK_LENGTH; j++) {
+    rotated[j] = maskingKey[(i + j) & 3];
+  }
+  memcpy(&key, rotated, WS_MASK_LENGTH);
+  // memcpy rather than a uint32_t pointer keeps this within the aliasing rules; it compiles to a plain load and store.
+  for (; i + 4 <= length; i += 4) {
+    memcpy(&word, data + i, 4);
+    word ^= key;
+    memcpy(data + i, &word, 4);
+  }
+
+  for (; i < length; i++) {
+    data[i] ^= maskingKey[i & 3];
+  }
+}
+
+/*
+ * xorshift32: a few shifts per call, good enough for masking keys, which
+ * only have to be unpredictable to intermediaries, not cryptographically strong.
+ */
+uint32_t wsRandom(uint32_t *state) {
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
@@ -0,0 +1,23 @@
+#ifndef WEBSOCKETFRAME_H
+#define WEBSOCKETFRAME_H
+
+#include <Ethernet.h>
+#include <Arduino.h>
+
+// Longest wait for the rest of a frame's payload; a peer that stalls mid-frame must not hold up the other connections.
+#ifndef WS_FRAME_TIMEOUT
+#define WS_FRAME_TIMEOUT       250     // milliseconds
+#endif
+
+/*
+ * Frame codec shared by the server (WebSocket) and the client (WebSocketClient).
+ * Frames sent by a client carry a masking key, frames sent by a server do not.
+ */
+int wsEncodeHeader(uint8_t *header, uint32_t payloadLength, uint8_t opcode, const uint8_t *maskingKey = NULL, bool fin = true);
+int wsEncodeFrame(uint8_t *frame, uint8_t *payloadData, uint8_t payloadLength, uint8_t opcode, const uint8_t *maskingKey = NULL);
+int wsReadFrame(Client &client, char *payloadData, int *payloadLength, unsigned long timeout = WS_FRAME_TIMEOUT);
+int wsReadLine(Client &client, char *buffer, uint8_t bufferLength, unsigned long timeout = 0);
+void wsMask(uint8_t *data, int length, const uint8_t *maskingKey);
+uint32_t wsRandom(uint32_t *state);
+
+#endif /* WEBSOCKETFRAME_H */
@@ -0,0 +1,76 @@
+#include "WebSocketQueue.h"
+
+void wsQueueInit(wsSubmitQueue *queue) {
+  for (int i = 0; i < WS_SUBMIT_QUEUE_LENGTH; i++) {
+    WS_STORE(queue->entries[i].sequence, i);
+  }
+  WS_STORE(queue->enqueuePosition, 0);
+  queue->dequeuePosition = 0;
+}
+
+// Copies the message into the queue without blocking; false when it is full.
+bool wsQueuePost(wsSubmitQueue *queue, int clientId, const uint8_t *payload, uint8_t payloadLength, uint8_t opcode) {
+  wsSubmission *entry;
+  uint8_t position;
+
+  if (payloadLength > WS_SUBMIT_PAYLOAD_LENGTH) {
+    return false;
+  }
+
+#ifdef __AVR__
+  uint8_t sreg = SREG;
+
+  cli();
+  position = queue->enqueuePosition;
+  entry = &queue->entries[position & (WS_SUBMIT_QUEUE_LENGTH - 1)];
+  if (entry->sequence != position) {
+    SREG = sreg;
+    return false;
+  }
+  queue->enqueuePosition = position + 1;
+  SREG = sreg;
+#else
+  int8_t difference;
+
+  position = queue->enqueuePosition.load(std::memory_order_relaxed);
+  for (;;) {
+    entry = &queue->entries[position & (WS_SUBMIT_QUEUE_LENGTH - 1)];
+    difference = (int8_t)(WS_LOAD(entry->sequence) - position);
+    if (difference == 0) {
+      // The entry is free at our position; take it unless another producer got there first.
+      if (queue->enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = queue->enqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+#endif
+
+  entry->clientId = clientId;
+  entry->opcode = opcode;
+  entry->payloadLength = payloadLength;
+  memcpy(entry->payload, payload, payloadLength);
+  WS_STORE(entry->sequence, position + 1);
+  return true;
+}
+
+// The oldest filled entry, or NULL if there is none.
+wsSubmission *wsQueuePeek(wsSubmitQueue *queue) {
+  wsSubmission *entry = &queue->entries[queue->dequeuePosition & (WS_SUBMIT_QUEUE_LENGTH - 1)];
+
+  if (WS_LOAD(entry->sequence) != (uint8_t)(queue->dequeuePosition + 1)) {
+    return NULL;
+  }
+  return entry;
+}
+
+// Hands the entry returned by wsQueuePeek back to the producers.
+void wsQueuePop(wsSubmitQueue *queue) {
+  wsSubmission *entry = &queue->entries[queue->dequeuePosition & (WS_SUBMIT_QUEUE_LENGTH - 1)];
+
+  WS_STORE(entry->sequence, queue->dequeuePosition + WS_SUBMIT_QUEUE_LENGTH);
+  queue->dequeuePosition++;
+}
@@ -0,0 +1,51 @@
+#ifndef WEBSOCKETQUEUE_H
+#define WEBSOCKETQUEUE_H
+
+#include <Arduino.h>
+
+/*
+ * Bounded multi-producer, single-consumer queue of messages to send. Any
+ * thread (or, on AVR, interrupt handler) may post; only the loop calling
+ * WebSocket::available() takes entries out. Each entry carries a sequence
+ * number that says whose turn it is: equal to the position when free for
+ * a producer, one past it when filled for the consumer.
+ */
+#ifndef WS_SUBMIT_QUEUE_LENGTH
+#define WS_SUBMIT_QUEUE_LENGTH     4     // power of two, at most 64
+#endif
+#ifndef WS_SUBMIT_PAYLOAD_LENGTH
+#define WS_SUBMIT_PAYLOAD_LENGTH  32
+#endif
+
+#ifdef __AVR__
+// No <atomic>: single-byte loads and stores are atomic, and claiming an entry briefly masks interrupts.
+typedef volatile uint8_t wsAtomicIndex;
+#define WS_LOAD(index)            (index)
+#define WS_STORE(index, value)    ((index) = (value))
+#else
+#include <atomic>
+typedef std::atomic<uint8_t> wsAtomicIndex;
+#define WS_LOAD(index)            (index).load(std::memory_order_acquire)
+#define WS_STORE(index, value)    (index).store((value), std::memory_order_release)
+#endif
+
+typedef struct {
+  wsAtomicIndex sequence;
+  int8_t clientId;            // or WS_SENDTO_ALL
+  uint8_t opcode;
+  uint8_t payloadLength;
+  uint8_t payload[WS_SUBMIT_PAYLOAD_LENGTH];
+} wsSubmission;
+
+typedef struct {
+  wsSubmission entries[WS_SUBMIT_QUEUE_LENGTH];
+  wsAtomicIndex enqueuePosition;
+  uint8_t dequeuePosition;    // only touched by the consumer
+} wsSubmitQueue;
+
+void wsQueueInit(wsSubmitQueue *queue);
+bool wsQueuePost(wsSubmitQueue *queue, int clientId, const uint8_t *payload, uint8_t payloadLength, uint8_t opcode);
+wsSubmission *wsQueuePeek(wsSubmitQueue *queue);
+void wsQueuePop(wsSubmitQueue *queue);
+
+#endif /* WEBSOCKETQUEUE_H */
@@ -0,0 +1,111 @@
+#include "WebSocketTimer.h"
+
+static void link(wsTimer **head, wsTimer *timer) {
+  timer->next = *head;
+  if (timer->next) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+}
+
+void wsTimerInit(wsTimerWheel *wheel, unsigned long now) {
+  for (int i = 0; i < WS_TIMER_SLOTS; i++) {
+    wheel->slot[i] = NULL;
+  }
+  wheel->tick = 0;
+  wheel->tickedAt = now;
+}
+
+// Ticks after the current one until expires is due; at least 1.
+static unsigned long ticksUntil(wsTimerWheel *wheel, unsigned long expires) {
+  long remaining = (long)(expires - wheel->tickedAt);
+
+  // A slot that has already been run this turn would not be looked at again for a whole turn.
+  if (remaining <= WS_TIMER_TICK) {
+    return 1;
+  }
+  return ((unsigned long)remaining + WS_TIMER_TICK - 1) / WS_TIMER_TICK;
+}
+
+void wsTimerSchedule(wsTimerWheel *wheel, wsTimer *timer, unsigned long expires) {
+  wsTimerCancel(timer);
+  timer->expires = expires;
+  link(&wheel->slot[(wheel->tick + ticksUntil(wheel, expires)) % WS_TIMER_SLOTS], timer);
+}
+
+void wsTimerCancel(wsTimer *timer) {
+  if (!timer->pprev) {
+    return;
+  }
+  *timer->pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->pprev = NULL;
+}
+
+// Runs the callbacks of the timers that have expired by now.
+void wsTimerTick(wsTimerWheel *wheel, unsigned long now) {
+  unsigned long ticks = (now - wheel->tickedAt) / WS_TIMER_TICK;
+  wsTimer *pending;
+  wsTimer *timer;
+
+  // After a long gap one turn is enough: it runs every slot once.
+  if (ticks > WS_TIMER_SLOTS) {
+    wheel->tick += ticks - WS_TIMER_SLOTS;
+    wheel->tickedAt += (ticks - WS_TIMER_SLOTS) * WS_TIMER_TICK;
+    ticks = WS_TIMER_SLOTS;
+  }
+  for (; ticks > 0; ticks--) {
+    wheel->tick++;
+    wheel->tickedAt += WS_TIMER_TICK;
+    // Detach the slot first: callbacks may schedule and cancel timers, including these.
+    pending = wheel->slot[wheel->tick % WS_TIMER_SLOTS];
+    wheel->slot[wheel->tick % WS_TIMER_SLOTS] = NULL;
+    if (pending) {
+      pending->pprev = &pending;
+    }
+    while ((timer = pending)) {
+      wsTimerCancel(timer);
+      if ((long)(now - timer->expires) >= 0) {
+        timer->callback(timer->clientId);
+      } else {
+        wsTimerSchedule(wheel, timer, timer->expires);
+      }
+    }
+  }
+}
+
+// Milliseconds until the next timer expires, at most timeout.
+unsigned long wsTimerNext(wsTimerWheel *wheel, unsigned long now, unsigned long timeout) {
+  unsigned long due = timeout;
+  unsigned long remaining;
+  unsigned long earliest = 0;
+  wsTimer *timer;
+  bool found = false;
+  bool waiting = false;
+
+  for (unsigned long ticks = 1; ticks <= WS_TIMER_SLOTS; ticks++) {
+    for (timer = wheel->slot[(wheel->tick + ticks) % WS_TIMER_SLOTS]; timer; timer = timer->next) {
+      // Timers in this slot for a later turn are skipped.
+      if (ticksUntil(wheel, timer->expires) <= ticks) {
+        remaining = (long)(timer->expires - now) > 0 ? timer->expires - now : 0;
+        if (!found || remaining < earliest) {
+          earliest = remaining;
+        }
+        found = true;
+      }
+      waiting = true;
+    }
+    // Slots come up in order, so the first one with a timer due this turn holds the earliest.
+    if (found) {
+      return earliest < timeout ? earliest : timeout;
+    }
+  }
+  // Everything is at least a turn away; look again then.
+  if (waiting && (unsigned long)WS_TIMER_SLOTS * WS_TIMER_TICK < due) {
+    due = (unsigned long)WS_TIMER_SLOTS * WS_TIMER_TICK;
+  }
+  return due;
+}
@@ -0,0 +1,41 @@
+#ifndef WEBSOCKETTIMER_H
+#define WEBSOCKETTIMER_H
+
+#include <Arduino.h>
+
+/*
+ * Hashed timer wheel. A timer sits in the slot of the tick it expires in,
+ * so scheduling and cancelling are O(1) and a tick only looks at the
+ * timers due around then. Timers further out than one turn of the wheel
+ * stay in their slot until their turn comes. Timers are owned by the
+ * caller; the wheel only links them together. Only differences of
+ * millis() are used, so the wheel keeps going when millis() wraps.
+ */
+#define WS_TIMER_TICK           10     // milliseconds per slot
+#ifndef WS_TIMER_SLOTS
+#define WS_TIMER_SLOTS          16
+#endif
+
+typedef void (*onTimer_t)(int clientId);
+
+typedef struct wsTimer {
+  struct wsTimer *next;
+  struct wsTimer **pprev;     // the pointer that points here; NULL when not scheduled
+  unsigned long expires;      // millis()
+  onTimer_t callback;
+  int clientId;
+} wsTimer;
+
+typedef struct {
+  wsTimer *slot[WS_TIMER_SLOTS];
+  unsigned long tick;         // last tick whose slot has been run; counts from 0, not from millis()
+  unsigned long tickedAt;     // millis() when that tick was due; moves in whole ticks so the remainder carries over
+} wsTimerWheel;
+
+void wsTimerInit(wsTimerWheel *wheel, unsigned long now);
+void wsTimerSchedule(wsTimerWheel *wheel, wsTimer *timer, unsigned long expires);
+void wsTimerCancel(wsTimer *timer);
+void wsTimerTick(wsTimerWheel *wheel, unsigned long now);
+unsigned long wsTimerNext(wsTimerWheel *wheel, unsigned long now, unsigned long timeout);
+
+#endif /* WEBSOCKETTIMER_H */
@@ -1,9 +1,16 @@
+#include <string.h>
+#include "base64.h"
+
 void base64Encode(char *input, char *output) {
+  base64Encode((uint8_t *)input, strlen(input), output);
+}
+
+void base64Encode(const uint8_t *input, int inputLength, char *output) {
   const char *encTable = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
   int inPos = 0, outPos = 0;
   int remainder = 0;
 
-  for (char *p = input; *p; p++, inPos++) {
+  for (; inPos < inputLength; inPos++) {
     switch (remainder = inPos % 3) {
     case 0:
       output[outPos++] = encTable[((input[inPos] >> 2) & 0x3f)];
@@ -18,7 +25,7 @@ void base64Encode(char *input, char *output) {
     }
   }
   
-  if (remainder != 2) { /* inPos is incremented at the for loop above. */
+  if (inputLength > 0 && remainder != 2) { /* inPos is incremented at the for loop above. */
     output[outPos++] = encTable[(input[inPos - 1] << (4 - 2 * remainder)) & 0x3f]; /* Pads 0s */
   }
   
@@ -28,5 +35,3 @@ void base64Encode(char *input, char *output) {
 
   output[outPos] = '\0';
 }
-
-
@@ -1,6 +1,9 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+#include <stdint.h>
+
 void base64Encode(char *input, char *output);
+void base64Encode(const uint8_t *input, int inputLength, char *output);
 
 #endif /* BASE64_H */
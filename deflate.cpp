@@ -0,0 +1,373 @@
+#include <string.h>
+#include "deflate.h"
+
+static const uint16_t lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distanceBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distanceExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t codeLengthOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/*
+ *  Encoder
+ */
+typedef struct {
+  uint8_t *output;
+  int outputLength;
+  int position;
+  uint32_t bits;
+  int bitCount;
+} BitWriter;
+
+static void putBits(BitWriter *w, uint32_t value, int count) {
+  w->bits |= value << w->bitCount;
+  w->bitCount += count;
+  while (w->bitCount >= 8) {
+    if (w->position < w->outputLength) {
+      w->output[w->position] = (uint8_t)w->bits;
+    }
+    w->position++;
+    w->bits >>= 8;
+    w->bitCount -= 8;
+  }
+}
+
+/* Huffman codes are defined MSB first but packed LSB first. */
+static void putCode(BitWriter *w, uint16_t code, int length) {
+  uint16_t reversed = 0;
+
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  putBits(w, reversed, length);
+}
+
+static void putLiteral(BitWriter *w, int symbol) {
+  if (symbol < 144) {
+    putCode(w, 0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    putCode(w, 0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    putCode(w, symbol - 256, 7);
+  } else {
+    putCode(w, 0xc0 + symbol - 280, 8);
+  }
+}
+
+static void putMatch(BitWriter *w, int length, int distance) {
+  int code;
+
+  for (code = 28; lengthBase[code] > length; code--) {
+    ;
+  }
+  putLiteral(w, 257 + code);
+  putBits(w, length - lengthBase[code], lengthExtra[code]);
+
+  for (code = 29; distanceBase[code] > distance; code--) {
+    ;
+  }
+  putCode(w, code, 5);
+  putBits(w, distance - distanceBase[code], distanceExtra[code]);
+}
+
+static int hash(const uint8_t *p) {
+  return ((p[0] << 4) ^ (p[1] << 2) ^ p[2]) & ((1 << DEFLATE_HASH_BITS) - 1);
+}
+
+static void insert(DeflateArena *arena, const uint8_t *input, int position) {
+  int h = hash(input + position);
+
+  arena->encoder.prev[position] = arena->encoder.head[h];
+  arena->encoder.head[h] = position + 1;
+}
+
+/*
+ *  Returns the compressed length, or -1 if input is too long or the result
+ *  does not fit in output.
+ */
+int deflateEncode(DeflateArena *arena, const uint8_t *input, int inputLength, uint8_t *output, int outputLength, int windowSize) {
+  BitWriter w = {output, outputLength, 0, 0, 0};
+  int bestLength;
+  int bestDistance;
+  int length;
+  int chain;
+
+  if (inputLength > DEFLATE_MAX_INPUT) {
+    return -1;
+  }
+  memset(arena->encoder.head, 0, sizeof(arena->encoder.head));
+
+  putBits(&w, 0, 1);   /* BFINAL = 0 */
+  putBits(&w, 1, 2);   /* BTYPE = 01, fixed Huffman codes */
+
+  for (int i = 0; i < inputLength; ) {
+    bestLength = 0;
+    bestDistance = 0;
+    if (i + 3 <= inputLength) {
+      chain = DEFLATE_MAX_CHAIN;
+      for (int candidate = arena->encoder.head[hash(input + i)]; candidate && chain--; candidate = arena->encoder.prev[candidate - 1]) {
+        if (i - (candidate - 1) > windowSize) {
+          break;
+        }
+        for (length = 0; i + length < inputLength && length < 258 && input[candidate - 1 + length] == input[i + length]; length++) {
+          ;
+        }
+        if (length > bestLength) {
+          bestLength = length;
+          bestDistance = i - (candidate - 1);
+        }
+      }
+      insert(arena, input, i);
+    }
+
+    if (bestLength >= 3) {
+      putMatch(&w, bestLength, bestDistance);
+      for (int j = i + 1; j < i + bestLength && j + 3 <= inputLength; j++) {
+        insert(arena, input, j);
+      }
+      i += bestLength;
+    } else {
+      putLiteral(&w, input[i]);
+      i++;
+    }
+    if (w.position > outputLength) {
+      return -1;
+    }
+  }
+
+  putLiteral(&w, 256);   /* end of block */
+  putBits(&w, 0, 3);     /* empty stored block header, its LEN/NLEN are left out */
+  putBits(&w, 0, (8 - w.bitCount) & 7);
+
+  return w.position <= outputLength ? w.position : -1;
+}
+
+/*
+ *  Decoder
+ */
+typedef struct {
+  const uint8_t *input;
+  int inputLength;
+  int position;
+  uint32_t bits;
+  int bitCount;
+  int error;
+} BitReader;
+
+static int getBits(BitReader *r, int count) {
+  int value;
+
+  while (r->bitCount < count) {
+    if (r->position >= r->inputLength) {
+      r->error = 1;
+      return 0;
+    }
+    r->bits |= (uint32_t)r->input[r->position++] << r->bitCount;
+    r->bitCount += 8;
+  }
+  value = r->bits & ((1UL << count) - 1);
+  r->bits >>= count;
+  r->bitCount -= count;
+  return value;
+}
+
+static int remainingBits(BitReader *r) {
+  return (r->inputLength - r->position) * 8 + r->bitCount;
+}
+
+static void buildTree(DeflateTree *tree, const uint8_t *lengths, int count) {
+  uint16_t offsets[16];
+
+  memset(tree->counts, 0, sizeof(tree->counts));
+  for (int i = 0; i < count; i++) {
+    tree->counts[lengths[i]]++;
+  }
+  tree->counts[0] = 0;
+
+  offsets[1] = 0;
+  for (int i = 1; i < 15; i++) {
+    offsets[i + 1] = offsets[i] + tree->counts[i];
+  }
+  for (int i = 0; i < count; i++) {
+    if (lengths[i]) {
+      tree->symbols[offsets[lengths[i]]++] = i;
+    }
+  }
+}
+
+/* Canonical Huffman decode, one bit at a time. */
+static int decodeSymbol(BitReader *r, DeflateTree *tree) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+
+  for (int length = 1; length < 16; length++) {
+    code |= getBits(r, 1);
+    if (r->error) {
+      return -1;
+    }
+    if (code - tree->counts[length] < first) {
+      return tree->symbols[index + code - first];
+    }
+    index += tree->counts[length];
+    first = (first + tree->counts[length]) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static void buildFixedTrees(DeflateArena *arena) {
+  uint8_t *lengths = arena->decoder.lengths;
+
+  memset(lengths, 8, 144);
+  memset(lengths + 144, 9, 112);
+  memset(lengths + 256, 7, 24);
+  memset(lengths + 280, 8, 8);
+  buildTree(&arena->decoder.literals, lengths, 288);
+  memset(lengths, 5, 30);
+  buildTree(&arena->decoder.distances, lengths, 30);
+}
+
+static int buildDynamicTrees(DeflateArena *arena, BitReader *r) {
+  uint8_t *lengths = arena->decoder.lengths;
+  int literalCount = getBits(r, 5) + 257;
+  int distanceCount = getBits(r, 5) + 1;
+  int codeLengthCount = getBits(r, 4) + 4;
+  int symbol;
+  int repeat;
+  uint8_t value;
+
+  if (literalCount > 286 || distanceCount > 30) {
+    return -1;
+  }
+
+  /* The code length alphabet is decoded with the distance tree as scratch. */
+  memset(lengths, 0, 19);
+  for (int i = 0; i < codeLengthCount; i++) {
+    lengths[codeLengthOrder[i]] = getBits(r, 3);
+  }
+  buildTree(&arena->decoder.distances, lengths, 19);
+
+  for (int i = 0; i < literalCount + distanceCount; ) {
+    if ((symbol = decodeSymbol(r, &arena->decoder.distances)) < 0) {
+      return -1;
+    }
+    if (symbol < 16) {
+      lengths[i++] = symbol;
+      continue;
+    }
+    if (symbol == 16) {
+      if (i == 0) {
+        return -1;
+      }
+      value = lengths[i - 1];
+      repeat = getBits(r, 2) + 3;
+    } else if (symbol == 17) {
+      value = 0;
+      repeat = getBits(r, 3) + 3;
+    } else {
+      value = 0;
+      repeat = getBits(r, 7) + 11;
+    }
+    if (i + repeat > literalCount + distanceCount) {
+      return -1;
+    }
+    while (repeat--) {
+      lengths[i++] = value;
+    }
+  }
+
+  buildTree(&arena->decoder.literals, lengths, literalCount);
+  buildTree(&arena->decoder.distances, lengths + literalCount, distanceCount);
+  return r->error ? -1 : 0;
+}
+
+/*
+ *  Returns the decompressed length, or -1 on malformed input or when the
+ *  result does not fit in output. The output buffer is the whole window.
+ */
+int deflateDecode(DeflateArena *arena, const uint8_t *input, int inputLength, uint8_t *output, int outputLength) {
+  BitReader r = {input, inputLength, 0, 0, 0, 0};
+  int position = 0;
+  int final = 0;
+  int type;
+  int symbol;
+  int length;
+  int distance;
+
+  /* A message ends after a final block, or where a stripped sync flush leaves only padding. */
+  while (!final && remainingBits(&r) > 8) {
+    final = getBits(&r, 1);
+    type = getBits(&r, 2);
+
+    if (type == 0) {
+      r.bits = 0;
+      r.bitCount = 0;
+      if (r.position + 4 > inputLength) {
+        break;   /* the stripped 00 00 ff ff */
+      }
+      length = input[r.position] | (input[r.position + 1] << 8);
+      if ((length ^ 0xffff) != (input[r.position + 2] | (input[r.position + 3] << 8))) {
+        return -1;
+      }
+      r.position += 4;
+      if (r.position + length > inputLength || position + length > outputLength) {
+        return -1;
+      }
+      memcpy(output + position, input + r.position, length);
+      r.position += length;
+      position += length;
+      continue;
+    } else if (type == 1) {
+      buildFixedTrees(arena);
+    } else if (type == 2) {
+      if (buildDynamicTrees(arena, &r) < 0) {
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+
+    while ((symbol = decodeSymbol(&r, &arena->decoder.literals)) != 256) {
+      if (symbol < 0) {
+        return -1;
+      } else if (symbol < 256) {
+        if (position >= outputLength) {
+          return -1;
+        }
+        output[position++] = symbol;
+      } else {
+        symbol -= 257;
+        if (symbol >= 29) {
+          return -1;
+        }
+        length = lengthBase[symbol] + getBits(&r, lengthExtra[symbol]);
+        if ((symbol = decodeSymbol(&r, &arena->decoder.distances)) < 0 || symbol >= 30) {
+          return -1;
+        }
+        distance = distanceBase[symbol] + getBits(&r, distanceExtra[symbol]);
+        if (r.error || distance > position || position + length > outputLength) {
+          return -1;
+        }
+        for (; length; length--, position++) {
+          output[position] = output[position - distance];
+        }
+      }
+    }
+  }
+
+  return r.error ? -1 : position;
+}
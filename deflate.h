@@ -0,0 +1,40 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stdint.h>
+
+/*
+ * Raw DEFLATE (RFC 1951) for small messages, running entirely inside a
+ * caller-provided arena so memory use is fixed at compile time.
+ *
+ * deflateEncode emits one fixed-Huffman block followed by the header of an
+ * empty stored block, i.e. a sync flush with the trailing 00 00 ff ff
+ * removed, as permessage-deflate (RFC 7692) expects. deflateDecode accepts
+ * such messages as well as messages ending in a final block.
+ */
+
+#define DEFLATE_HASH_BITS      6
+#define DEFLATE_MAX_CHAIN      8
+#define DEFLATE_MAX_INPUT    255     /* positions are kept in uint8_t */
+
+typedef struct {
+  uint16_t counts[16];
+  uint16_t symbols[288];
+} DeflateTree;
+
+typedef union {
+  struct {
+    uint8_t head[1 << DEFLATE_HASH_BITS];   /* last position + 1 with this hash, 0 if none */
+    uint8_t prev[DEFLATE_MAX_INPUT];        /* previous position + 1 with the same hash */
+  } encoder;
+  struct {
+    DeflateTree literals;
+    DeflateTree distances;
+    uint8_t lengths[288 + 32];
+  } decoder;
+} DeflateArena;
+
+int deflateEncode(DeflateArena *arena, const uint8_t *input, int inputLength, uint8_t *output, int outputLength, int windowSize);
+int deflateDecode(DeflateArena *arena, const uint8_t *input, int inputLength, uint8_t *output, int outputLength);
+
+#endif /* DEFLATE_H */
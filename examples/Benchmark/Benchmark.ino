@@ -0,0 +1,242 @@
+/*
+ * Microbenchmarks for the handshake and frame paths.
+ *
+ * Each result is printed on its own line as JSON so a capture of the
+ * serial output can be diffed or parsed between builds:
+ *   {"bench":"sha1_64","iterations":1000,"usPerOp":412.50}
+ */
+#include <SPI.h>
+#include <Ethernet.h>
+#include <WebSocket.h>
+#include <WebSocketFrame.h>
+#include <sha1.h>
+#include <base64.h>
+
+#define ITERATIONS 1000
+
+char wsKey[WS_MAX_LINE_LENGTH];
+uint8_t digest[SHA1HashSize];
+char accept[WS_ACCEPT_LENGTH + 1];
+uint8_t payload[WS_MAX_PAYLOAD_LENGTH];
+uint8_t frame[WS_MAX_HEADER_LENGTH + WS_MASK_LENGTH + WS_MAX_PAYLOAD_LENGTH];
+const uint8_t maskingKey[WS_MASK_LENGTH] = {0x37, 0xfa, 0x21, 0x3d};
+uint8_t image[512];
+
+// Takes whatever it is given, so only the library's side of a send is timed.
+class Sink : public Print {
+public:
+  size_t write(uint8_t) { return 1; }
+  size_t write(const uint8_t *, size_t size) { return size; }
+} sink;
+
+// Serves the same bytes over and over, so the library's read paths can be timed without a network.
+class MemoryClient : public Client {
+public:
+  void load(const uint8_t *bytes, uint16_t size) { data = bytes; length = size; position = 0; }
+  void rewind() { position = 0; }
+  int connect(IPAddress, uint16_t) { return 0; }
+  int connect(const char *, uint16_t) { return 0; }
+  size_t write(uint8_t) { return 1; }
+  size_t write(const uint8_t *, size_t size) { return size; }
+  int available() { return length - position; }
+  int read() { return position < length ? data[position++] : -1; }
+  int read(uint8_t *buf, size_t size) {
+    if (size > (size_t)(length - position)) {
+      size = length - position;
+    }
+    memcpy(buf, data + position, size);
+    position += size;
+    return size;
+  }
+  int peek() { return position < length ? data[position] : -1; }
+  void flush() {}
+  void stop() {}
+  uint8_t connected() { return position < length; }
+  operator bool() { return true; }
+private:
+  const uint8_t *data;
+  uint16_t length;
+  uint16_t position;
+} memoryClient;
+
+const char request[] =
+  "GET /chat HTTP/1.1\r\n"
+  "Host: server.example.com\r\n"
+  "Upgrade: websocket\r\n"
+  "Connection: Upgrade\r\n"
+  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+  "Origin: http://example.com\r\n"
+  "Sec-WebSocket-Protocol: chat, superchat\r\n"
+  "Sec-WebSocket-Version: 13\r\n"
+  "\r\n";
+
+char *protocols[] = {(char *)"chat"};
+WebSocket wsServer(80, protocols, 1);
+
+void report(const char *name, unsigned long elapsed) {
+  Serial.print("{\"bench\":\"");
+  Serial.print(name);
+  Serial.print("\",\"iterations\":");
+  Serial.print(ITERATIONS);
+  Serial.print(",\"usPerOp\":");
+  Serial.print((float)elapsed / ITERATIONS);
+  Serial.println("}");
+}
+
+void benchAccept() {
+  SHA1Context sha;
+  unsigned long start = micros();
+
+  // The work handshake() does per connection once the headers are parsed.
+  for (int i = 0; i < ITERATIONS; i++) {
+    strcpy(wsKey, "dGhlIHNhbXBsZSBub25jZQ==");
+    strcat(wsKey, WS_GUID);
+    SHA1Reset(&sha);
+    SHA1Input(&sha, (uint8_t *)wsKey, strlen(wsKey));
+    SHA1Result(&sha, digest);
+    base64Encode(digest, SHA1HashSize, accept);
+  }
+  report("handshake_accept", micros() - start);
+}
+
+void benchSha1() {
+  SHA1Context sha;
+  unsigned long start = micros();
+
+  for (int i = 0; i < ITERATIONS; i++) {
+    SHA1Reset(&sha);
+    SHA1Input(&sha, payload, 64);
+    SHA1Result(&sha, digest);
+  }
+  report("sha1_64", micros() - start);
+}
+
+void benchBase64() {
+  unsigned long start = micros();
+
+  for (int i = 0; i < ITERATIONS; i++) {
+    base64Encode(digest, SHA1HashSize, accept);
+  }
+  report("base64_20", micros() - start);
+}
+
+void benchEncode(uint8_t length) {
+  unsigned long start = micros();
+
+  // sendPayload() minus the transport write.
+  for (int i = 0; i < ITERATIONS; i++) {
+    wsEncodeFrame(frame, payload, length, WS_FRAME_BINARY);
+  }
+  report(length > 16 ? "encode_125" : "encode_16", micros() - start);
+}
+
+void benchMaskedEncode() {
+  unsigned long start = micros();
+
+  // What WebSocketClient pays per frame.
+  for (int i = 0; i < ITERATIONS; i++) {
+    wsEncodeFrame(frame, payload, WS_MAX_PAYLOAD_LENGTH, WS_FRAME_BINARY, maskingKey);
+  }
+  report("encode_masked_125", micros() - start);
+}
+
+void benchUnmask() {
+  unsigned long start = micros();
+
+  // The unmasking step of wsReadFrame(); the socket reads are measured by LoadTest.
+  for (int i = 0; i < ITERATIONS; i++) {
+    wsMask(payload, WS_MAX_PAYLOAD_LENGTH, maskingKey);
+  }
+  report("unmask_125", micros() - start);
+}
+
+void benchParseRequest() {
+  char requestURI[WS_MAX_LINE_LENGTH];
+  int protocol;
+  int deflateBits;
+  unsigned long start = micros();
+
+  // The header half of handshake(), reading the request a line at a time as it would off the socket.
+  memoryClient.load((const uint8_t *)request, sizeof(request) - 1);
+  for (int i = 0; i < ITERATIONS; i++) {
+    memoryClient.rewind();
+    wsServer.parseRequest(memoryClient, requestURI, wsKey, &protocol, &deflateBits);
+  }
+  report("handshake_parse", micros() - start);
+}
+
+void benchDecode() {
+  char decoded[WS_MAX_PAYLOAD_LENGTH + 1];
+  int decodedLength;
+  int frameLength = wsEncodeFrame(frame, payload, WS_MAX_PAYLOAD_LENGTH, WS_FRAME_BINARY, maskingKey);
+  unsigned long start = micros();
+
+  // wsReadFrame() on what a browser sends: header, mask, masked payload.
+  memoryClient.load(frame, frameLength);
+  for (int i = 0; i < ITERATIONS; i++) {
+    memoryClient.rewind();
+    wsReadFrame(memoryClient, decoded, &decodedLength);
+  }
+  report("decode_masked_125", micros() - start);
+}
+
+void benchChunkedSend(uint16_t length) {
+  uint8_t chunk[WS_STREAM_CHUNK_SIZE];
+  char name[24];
+  unsigned long start = micros();
+
+  // sendStream(): every chunk is copied out of the source before it is written.
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink.write(frame, wsEncodeHeader(frame, length, WS_FRAME_BINARY));
+    for (uint16_t offset = 0; offset < length; offset += WS_STREAM_CHUNK_SIZE) {
+      uint16_t n = length - offset < WS_STREAM_CHUNK_SIZE ? length - offset : WS_STREAM_CHUNK_SIZE;
+      memcpy(chunk, image + offset, n);
+      sink.write(chunk, n);
+    }
+  }
+  snprintf(name, sizeof(name), "send_chunked_%u", length);
+  report(name, micros() - start);
+}
+
+void benchDirectSend(uint16_t length) {
+  char name[24];
+  unsigned long start = micros();
+
+  // sendBuffer(): the header, then the caller's memory as it is.
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink.write(frame, wsEncodeHeader(frame, length, WS_FRAME_BINARY));
+    sink.write(image, length);
+  }
+  snprintf(name, sizeof(name), "send_direct_%u", length);
+  report(name, micros() - start);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ;
+  }
+
+  for (int i = 0; i < WS_MAX_PAYLOAD_LENGTH; i++) {
+    payload[i] = i;
+  }
+
+  benchAccept();
+  benchSha1();
+  benchBase64();
+  benchEncode(16);
+  benchEncode(WS_MAX_PAYLOAD_LENGTH);
+  benchMaskedEncode();
+  benchUnmask();
+  benchParseRequest();
+  benchDecode();
+  // Into a sink that takes everything this is only the cost of the copies, which grows with the size;
+  // where sendBuffer() wins over a real transport depends on that transport's write().
+  for (uint16_t length = 64; length <= sizeof(image); length *= 2) {
+    benchChunkedSend(length);
+    benchDirectSend(length);
+  }
+}
+
+void loop() {
+}
@@ -0,0 +1,29 @@
+/*
+ * Echoes every message back to its sender. Also the target for LoadTest.
+ */
+#include <SPI.h>
+#include <Ethernet.h>
+#include <WebSocket.h>
+
+byte mac[] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED};
+IPAddress ip(192, 168, 1, 177);
+
+void onMessage(char *payload, int payloadLength, int clientId);
+
+WebSocket webSocket(80, (char *)"echo", NULL, onMessage);
+
+void onMessage(char *payload, int payloadLength, int clientId) {
+  webSocket.sendPayload((uint8_t *)payload, payloadLength, WS_FRAME_TEXT, clientId);
+}
+
+void setup() {
+  Ethernet.begin(mac, ip);
+  webSocket.begin();
+}
+
+void loop() {
+  int clientId;
+
+  webSocket.waitForEvent(1000);
+  webSocket.available(&clientId);
+}
@@ -0,0 +1,98 @@
+/*
+ * End-to-end load generator. Opens NUM_CLIENTS connections to a server
+ * running EchoServer, keeps one message in flight per connection, and
+ * reports throughput and round-trip latency percentiles as one JSON line:
+ *   {"clients":3,"messages":3000,"msgsPerSec":812.4,"p50Us":3480,"p99Us":5120}
+ */
+#include <SPI.h>
+#include <Ethernet.h>
+#include <WebSocket.h>
+#include <WebSocketClient.h>
+
+#define NUM_CLIENTS      3     // at most MAX_SOCK_NUM, one entry per client in clients[] below
+#define MESSAGES       1000    // per client
+#define MESSAGE_LENGTH   32
+
+byte mac[] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xEE};
+IPAddress ip(192, 168, 1, 178);
+IPAddress server(192, 168, 1, 177);
+
+void onMessage(char *payload, int payloadLength, int clientId);
+
+WebSocketClient clients[NUM_CLIENTS] = {
+  WebSocketClient(onMessage, NULL, 0),
+  WebSocketClient(onMessage, NULL, 1),
+  WebSocketClient(onMessage, NULL, 2),
+};
+unsigned long sentAt[NUM_CLIENTS];
+int received[NUM_CLIENTS];
+uint32_t latency[NUM_CLIENTS * MESSAGES / 16];  // every 16th sample, to fit in RAM
+int samples;
+char message[MESSAGE_LENGTH + 1];
+
+void onMessage(char *payload, int payloadLength, int clientId) {
+  unsigned long elapsed = micros() - sentAt[clientId];
+
+  if ((received[clientId]++ & 15) == 0 && samples < (int)(sizeof(latency) / sizeof(latency[0]))) {
+    latency[samples++] = elapsed;
+  }
+  if (received[clientId] < MESSAGES) {
+    sentAt[clientId] = micros();
+    clients[clientId].sendText(message);
+  }
+}
+
+int compare(const void *a, const void *b) {
+  return *(uint32_t *)a < *(uint32_t *)b ? -1 : *(uint32_t *)a > *(uint32_t *)b;
+}
+
+void setup() {
+  unsigned long start;
+  unsigned long elapsed;
+  int done;
+
+  Serial.begin(115200);
+  Ethernet.begin(mac, ip);
+  memset(message, 'x', MESSAGE_LENGTH);
+
+  for (int i = 0; i < NUM_CLIENTS; i++) {
+    if (clients[i].connect(server, 80, (char *)"192.168.1.177", (char *)"/", (char *)"echo") != WS_CONNECTED) {
+      Serial.println("{\"error\":\"connect\"}");
+      return;
+    }
+  }
+
+  start = micros();
+  for (int i = 0; i < NUM_CLIENTS; i++) {
+    sentAt[i] = micros();
+    clients[i].sendText(message);
+  }
+  do {
+    done = 0;
+    for (int i = 0; i < NUM_CLIENTS; i++) {
+      clients[i].available();
+      done += received[i] >= MESSAGES;
+    }
+  } while (done < NUM_CLIENTS);
+  elapsed = micros() - start;
+
+  qsort(latency, samples, sizeof(latency[0]), compare);
+  Serial.print("{\"clients\":");
+  Serial.print(NUM_CLIENTS);
+  Serial.print(",\"messages\":");
+  Serial.print((unsigned long)NUM_CLIENTS * MESSAGES);
+  Serial.print(",\"msgsPerSec\":");
+  Serial.print((float)NUM_CLIENTS * MESSAGES * 1000000.0 / elapsed);
+  Serial.print(",\"p50Us\":");
+  Serial.print(latency[samples / 2]);
+  Serial.print(",\"p99Us\":");
+  Serial.print(latency[samples * 99 / 100]);
+  Serial.println("}");
+
+  for (int i = 0; i < NUM_CLIENTS; i++) {
+    clients[i].sendClose(WS_CLOSE_NORMAL);
+  }
+}
+
+void loop() {
+}